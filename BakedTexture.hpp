@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// Contenitore .dtex prodotto da TextureBaker e letto da Texture::loadBaked.
+/// Layout: BakedTextureHeader, poi i dati di ogni livello di mip (dal piu' grande), con tutte le facce
+/// di un livello una dopo l'altra. E' esattamente il layout che vkCmdCopyBufferToImage si aspetta con
+/// una regione per livello, per questo il file puo' essere mappato o letto direttamente nello staging buffer.
+/// Gli offset sono relativi all'inizio del file e allineati a BAKED_TEXTURE_ALIGNMENT byte.
+
+const char BAKED_TEXTURE_MAGIC[4] = {'D', 'T', 'E', 'X'};
+const uint32_t BAKED_TEXTURE_VERSION = 1;
+const uint32_t BAKED_TEXTURE_MAX_LEVELS = 16;
+const uint64_t BAKED_TEXTURE_ALIGNMENT = 16;
+
+/// stessi valori dei VkFormat corrispondenti, cosi' il baker non dipende da Vulkan
+enum BakedTextureFormat : uint32_t {
+    BAKED_FORMAT_R8G8B8A8_SRGB = 43,
+    /// blocchi 4x4 da 8 byte: RGB 5:6:5 con due colori interpolati, per immagini opache
+    BAKED_FORMAT_BC1_RGBA_SRGB = 134,
+    /// blocchi 4x4 da 16 byte: alpha a 8 livelli piu' un blocco BC1
+    BAKED_FORMAT_BC3_SRGB = 138,
+    /// blocchi 4x4 da 16 byte, qualita' migliore di BC1/BC3 (il baker usa solo il modo 6)
+    BAKED_FORMAT_BC7_SRGB = 146
+};
+
+/// byte per blocco 4x4 dei formati compressi, 0 per i formati non compressi
+inline uint32_t bakedFormatBlockSize(uint32_t format) {
+    switch (format) {
+        case BAKED_FORMAT_BC1_RGBA_SRGB:
+            return 8;
+        case BAKED_FORMAT_BC3_SRGB:
+        case BAKED_FORMAT_BC7_SRGB:
+            return 16;
+        default:
+            return 0;
+    }
+}
+
+struct BakedTextureLevel {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t width;
+    uint32_t height;
+};
+
+struct BakedTextureHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t mipLevels;
+    /// 1 per una texture 2D, 6 per una cubemap (+x, -x, +y, -y, +z, -z)
+    uint32_t layers;
+    uint32_t reserved;
+    BakedTextureLevel levels[BAKED_TEXTURE_MAX_LEVELS];
+};
+
+/// contenitori che possono sostituire i PNG, in ordine di preferenza: prima la versione compressa
+/// ("a.png" -> "a.bc.dtex", "a.dtex"; sei facce "posx.png"... -> "posx.cube.bc.dtex", "posx.cube.dtex")
+inline std::vector<std::string> bakedTexturePaths(const std::vector<std::string> &files) {
+    const std::string &first = files[0];
+    std::string extension = first.substr(first.find_last_of('.') + 1);
+    if (extension == "dtex") {
+        return {first};
+    }
+    std::string stem = first.substr(0, first.find_last_of('.')) + (files.size() == 6 ? ".cube" : "");
+    return {stem + ".bc.dtex", stem + ".dtex"};
+}
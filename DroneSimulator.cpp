@@ -1,5 +1,8 @@
 #include "Models.hpp"
 
+/// oggetti in piu' della scena di benchmark: eliche disposte a griglia sopra il terreno (0 nel simulatore)
+const int SWARM_SIZE = 0;
+
 // MAIN !
 class DroneSimulator : public BaseProject {
 
@@ -15,6 +18,7 @@ private:
             {GLFW_KEY_DOWN,  GLFW_RELEASE},
             {GLFW_KEY_RIGHT, GLFW_RELEASE},
             {GLFW_KEY_LEFT,  GLFW_RELEASE},
+            {GLFW_KEY_P,     GLFW_RELEASE},
     };
 
 protected:
@@ -23,22 +27,54 @@ protected:
     // Descriptor Layouts [what will be passed to the shaders]
     DescriptorSetLayout DSLglobal;
     DescriptorSetLayout DSLobj;
+    DescriptorSetLayout DSLtextures;
 
     DescriptorSet DS_global;
+    /// uniform buffer dinamico di terreno, drone, eliche e swarm: un blocco per oggetto, un solo set
+    DescriptorSet DS_objects;
+    /// texture di terreno, drone ed eliche in un unico array, legato una volta per frame
+    DescriptorSet DS_textures;
+    std::vector<Texture *> objectTextures;
 
     //Terrain
     Pipeline terrainPipeline;
-    Terrain terrain = Terrain(this, &DSLobj, &terrainPipeline);
+    /// terreno dopo il depth pre-pass: confronto EQUAL senza scrittura, ogni pixel viene shadato una sola volta
+    Pipeline terrainEqualPipeline;
+    /// depth pre-pass di terreno e drone: solo la posizione, nessun fragment shader
+    Pipeline depthPrePassPipeline;
+    Terrain terrain = Terrain(this, &DS_objects, &terrainPipeline);
 
     //Drone
     Pipeline dronePipeline;
-    Drone drone = Drone(this, &DSLobj, &dronePipeline, &cameraPosition, &terrain);
+    /// eliche del drone: stessi shader, ma la mesh glTF viene letta con VERTEX_STREAMS direttamente dai suoi buffer
+    Pipeline fanPipeline;
+    Drone drone = Drone(this, &DS_objects, &dronePipeline, &fanPipeline, &cameraPosition, &terrain);
 
     //Skybox
     DescriptorSetLayout SkyBoxDescriptorSetLayout; // for skybox
     Pipeline skyBoxPipeline;        // for skybox
     BaseModel skyboxBaseModel = BaseModel(this, &SkyBoxDescriptorSetLayout, &skyBoxPipeline);
 
+    /// scena di benchmark, disegnata con la pipeline del drone
+    std::deque<BaseModel> swarm;
+
+    /// oggetti da disegnare nel frame, ricostruita in updateUniformBuffer
+    std::vector<BaseModel *> drawList;
+    /// un disegno della drawList: con il depth pre-pass un oggetto viene disegnato con due pipeline diverse
+    struct DrawCall {
+        BaseModel *baseModel;
+        Pipeline *pipeline;
+    };
+    /// disegni del frame nell'ordine della renderQueue, divisi tra i thread che registrano i command buffer
+    std::vector<DrawCall> drawCalls;
+    /// chiavi di ordinamento dei drawCalls (pipeline, mesh, distanza dalla camera)
+    RenderQueue renderQueue;
+    std::vector<DrawCall> queuedCalls;
+    /// oggetti della scena con le loro bounding sphere in coordinate mondo, per il frustum culling
+    std::vector<BaseModel *> sceneModels;
+    std::vector<glm::vec4> sceneSpheres;
+    std::vector<unsigned char> sceneVisible;
+
     // Here you set the main application parameters
     void setWindowParameters() {
         // window size, title and initial background
@@ -48,21 +84,52 @@ protected:
         initialBackgroundColor = {0.0f, 0.0f, 0.0f, 1.0f};
 
         // Descriptor pool sizes
-        uniformBlocksInPool = 8;
-        texturesInPool = 7;
-        setsInPool = 8;
+        /// global e skybox; gli oggetti condividono un solo uniform buffer dinamico e il numero di set non dipende
+        /// da quanti sono
+        uniformBlocksInPool = 2;
+        dynamicUniformBlocksInPool = 1;
+        texturesInPool = MAX_OBJECT_TEXTURES + 1;
+        setsInPool = 4;
     }
 
     // Here you load and setup all your Vulkan objects
     void localInit(bool first = true) {
+        /// al primo avvio mesh e texture vengono decodificate in parallelo mentre si creano layout e pipeline
+        std::vector<std::future<void>> assetLoads;
+        if (first) {
+            assetLoads.push_back(std::async(std::launch::async, [this]() {
+                terrain.terrainBaseModel.load("models/Terrain.obj", {"textures/t2.png"});
+            }));
+            assetLoads.push_back(std::async(std::launch::async, [this]() {
+                drone.droneBaseModel.load("models/Drone.obj", {"textures/drone.png"});
+            }));
+            for (auto &i: drone.fanBaseModelList) {
+                assetLoads.push_back(std::async(std::launch::async, [&i]() {
+                    i.load("models/fan.glb", {"textures/fan.png"});
+                }));
+            }
+            assetLoads.push_back(std::async(std::launch::async, [this]() {
+                skyboxBaseModel.load("models/SkyBox.obj",
+                                     {"textures/posx.png", "textures/negx.png", "textures/posy.png",
+                                      "textures/negy.png", "textures/posz.png", "textures/negz.png"}, true);
+            }));
+        }
+
         // Descriptor Layouts [what will be passed to the shaders]
         DSLobj.init(this, {
                 // this array contains the binding:
                 // first  element : the binding number
                 // second element : the type of element (buffer or texture)
                 // third  element : the pipeline stage where it will be used
-                {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,         VK_SHADER_STAGE_VERTEX_BIT},
-                {1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT}
+                {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT}
+        });
+        /// terreno, drone, quattro eliche e swarm
+        DS_objects.init(this, &DSLobj, {
+                {0, UNIFORM_DYNAMIC, sizeof(UniformBufferObject), nullptr, {}, 6 + SWARM_SIZE}
+        });
+
+        DSLtextures.init(this, {
+                {0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, MAX_OBJECT_TEXTURES}
         });
 
         DSLglobal.init(this, {
@@ -72,41 +139,119 @@ protected:
                 {0, UNIFORM, sizeof(GlobalUniformBufferObject), nullptr}
         });
 
+        // Skybox
+        SkyBoxDescriptorSetLayout.init(this, {
+                {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,         VK_SHADER_STAGE_VERTEX_BIT},
+                {1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT}
+        });
+
         // Pipelines [Shader couples]
         // The last array, is a vector of pointer to the layouts of the sets that will
         // be used in this pipeline. The first element will be set 0, and so on...
+        /// le pipeline sono indipendenti tra loro e vengono compilate in parallelo
+        std::vector<std::future<void>> pipelineInits;
 
         // Terrain
-        terrainPipeline.init(this, "shaders/shaderTerrainVert.spv", "shaders/shaderTerrainFrag.spv",
-                             {&DSLglobal, &DSLobj}, first, false);
-
-        terrain.terrainBaseModel.init("models/Terrain.obj", {"textures/t2.png"}, first);
+        pipelineInits.push_back(std::async(std::launch::async, [this, first]() {
+            terrainPipeline.init(this, "shaders/shaderTerrainVert.spv", "shaders/shaderTerrainFrag.spv",
+                                 {&DSLglobal, &DSLobj, &DSLtextures}, first, false, VERTEX_PACKED,
+                                 sizeof(ObjectPushConstants));
+        }));
+        pipelineInits.push_back(std::async(std::launch::async, [this, first]() {
+            terrainEqualPipeline.init(this, "shaders/shaderTerrainVert.spv", "shaders/shaderTerrainFrag.spv",
+                                      {&DSLglobal, &DSLobj, &DSLtextures}, first, false, VERTEX_PACKED,
+                                      sizeof(ObjectPushConstants), DEPTH_EQUAL);
+        }));
+
+        // Depth pre-pass: stessi layout di terreno e drone, cosi' i descriptor set legati restano validi
+        pipelineInits.push_back(std::async(std::launch::async, [this, first]() {
+            depthPrePassPipeline.init(this, "shaders/shaderDepthVert.spv", "",
+                                      {&DSLglobal, &DSLobj, &DSLtextures}, first, false, VERTEX_PACKED,
+                                      sizeof(ObjectPushConstants), DEPTH_PREPASS);
+        }));
 
         // Drone
-        dronePipeline.init(this, "shaders/shaderDroneVert.spv", "shaders/shaderDroneFrag.spv", {&DSLglobal, &DSLobj},
-                           first,
-                           false);
+        pipelineInits.push_back(std::async(std::launch::async, [this, first]() {
+            dronePipeline.init(this, "shaders/shaderDroneVert.spv", "shaders/shaderDroneFrag.spv",
+                               {&DSLglobal, &DSLobj, &DSLtextures}, first, false, VERTEX_PACKED,
+                               sizeof(ObjectPushConstants));
+        }));
+        pipelineInits.push_back(std::async(std::launch::async, [this, first]() {
+            fanPipeline.init(this, "shaders/shaderDroneVert.spv", "shaders/shaderDroneFrag.spv",
+                             {&DSLglobal, &DSLobj, &DSLtextures}, first, false, VERTEX_STREAMS,
+                             sizeof(ObjectPushConstants));
+        }));
 
-        drone.droneBaseModel.init("models/Drone.obj", {"textures/drone.png"}, first);
-        for (auto &i: drone.fanBaseModelList) {
-            i.init("models/Fan.obj", {"textures/fan.png"}, first);//Texture to avoid errors
+        /// is skyBox server per impostare la rasterization a clockwise per visuliozzare la texture nelle faccie interne del cubo
+        pipelineInits.push_back(std::async(std::launch::async, [this, first]() {
+            skyBoxPipeline.init(this, "shaders/shaderSkyBoxVert.spv", "shaders/shaderSkyBoxFrag.spv",
+                                {&SkyBoxDescriptorSetLayout}, first, true);
+        }));
+
+        for (auto &pipelineInit: pipelineInits) {
+            pipelineInit.get();
+        }
+        for (auto &assetLoad: assetLoads) {
+            assetLoad.get();
         }
 
+        /// tutti gli upload su GPU vengono registrati in un solo command buffer e inviati con una submit
+        beginUploadBatch();
 
-        // Skybox
-        SkyBoxDescriptorSetLayout.init(this, {
-                {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,         VK_SHADER_STAGE_VERTEX_BIT},
-                {1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT}
-        });
+        terrain.terrainBaseModel.init("models/Terrain.obj", {"textures/t2.png"}, first);
+
+        drone.droneBaseModel.init("models/Drone.obj", {"textures/drone.png"}, first);
+        for (auto &i: drone.fanBaseModelList) {
+            i.init("models/fan.glb", {"textures/fan.png"}, first);//Texture to avoid errors
+        }
+        while (swarm.size() < SWARM_SIZE) {
+            swarm.emplace_back(this, &DS_objects, &dronePipeline);
+        }
+        for (auto &i: swarm) {
+            i.init("models/Fan.obj", {"textures/fan.png"}, first);
+        }
 
-        /// is skyBox server per impostare la rasterization a clockwise per visuliozzare la texture nelle faccie interne del cubo
-        skyBoxPipeline.init(this, "shaders/shaderSkyBoxVert.spv", "shaders/shaderSkyBoxFrag.spv",
-                            {&SkyBoxDescriptorSetLayout}, first, true);
         /// passo il modello del cubo dello skybox e una texture per ogni lato del cubo
         skyboxBaseModel.init("models/SkyBox.obj",
                              {"textures/posx.png", "textures/negx.png", "textures/posy.png", "textures/negy.png",
                               "textures/posz.png", "textures/negz.png"}, first, true);
 
+        endUploadBatch();
+
+        /// una voce per texture distinta (le eliche condividono la loro), gli elementi liberi ripetono la prima
+        objectTextures.clear();
+        addObjectTexture(terrain.terrainBaseModel);
+        addObjectTexture(drone.droneBaseModel);
+        for (auto &i: drone.fanBaseModelList) {
+            addObjectTexture(i);
+        }
+        for (auto &i: swarm) {
+            addObjectTexture(i);
+        }
+        std::vector<Texture *> textureArray = objectTextures;
+        textureArray.resize(MAX_OBJECT_TEXTURES, objectTextures[0]);
+        DS_textures.init(this, &DSLtextures, {
+                {0, TEXTURE_ARRAY, 0, nullptr, textureArray}
+        });
+    }
+
+    void addObjectTexture(BaseModel &baseModel) {
+        baseModel.textureIndex = objectTextureIndex(baseModel.texture.get());
+        baseModel.subMeshTextureIndices.clear();
+        for (auto &subMeshTexture: baseModel.subMeshTextures) {
+            baseModel.subMeshTextureIndices.push_back(objectTextureIndex(subMeshTexture.get()));
+        }
+    }
+
+    uint32_t objectTextureIndex(Texture *texture) {
+        auto it = std::find(objectTextures.begin(), objectTextures.end(), texture);
+        if (it == objectTextures.end()) {
+            if (objectTextures.size() == MAX_OBJECT_TEXTURES) {
+                throw std::runtime_error("too many object textures!");
+            }
+            it = objectTextures.insert(objectTextures.end(), texture);
+        }
+        return static_cast<uint32_t>(it - objectTextures.begin());
     }
 
     // Here you destroy all the objects you created!
@@ -117,55 +262,109 @@ protected:
         for (auto &i: drone.fanBaseModelList) {
             i.cleanUp(definitive);
         }
+        for (auto &i: swarm) {
+            i.cleanUp(definitive);
+        }
 
         DS_global.cleanup();
+        DS_objects.cleanup();
+        DS_textures.cleanup();
 
         terrainPipeline.cleanup();
+        terrainEqualPipeline.cleanup();
+        depthPrePassPipeline.cleanup();
         dronePipeline.cleanup();
+        fanPipeline.cleanup();
         DSLglobal.cleanup();
         DSLobj.cleanup();
+        DSLtextures.cleanup();
 
         skyboxBaseModel.cleanUp(definitive);
         skyBoxPipeline.cleanup();
         SkyBoxDescriptorSetLayout.cleanup();
+
+        /// libera mesh e texture non piu' usate da nessun modello
+        assetCache.collect();
     }
 
     // Here it is the creation of the command buffer:
     // You send to the GPU all the objects you want to draw,
     // with their buffers and textures
     void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) {
+        populateCommandBufferPart(commandBuffer, currentImage, 0, 1, CULL_PHASE_EARLY);
+    }
 
-        // Bind terrainPipeline
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                          terrainPipeline.graphicsPipeline);
-        vkCmdBindDescriptorSets(commandBuffer,
-                                VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                terrainPipeline.pipelineLayout, 0, 1, &DS_global.descriptorSets[currentImage],
-                                0, nullptr);
-
-        // Terrain
-        terrain.terrainBaseModel.populateCommandBuffer(&commandBuffer, currentImage, 1);
-
-        // Bind dronePipeline
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                          dronePipeline.graphicsPipeline);
-        vkCmdBindDescriptorSets(commandBuffer,
-                                VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                dronePipeline.pipelineLayout, 0, 1, &DS_global.descriptorSets[currentImage],
-                                0, nullptr);
-
-        // Drone
-        drone.droneBaseModel.populateCommandBuffer(&commandBuffer, currentImage, 1);
-        for (auto &fanBaseModel: drone.fanBaseModelList) {
-            fanBaseModel.populateCommandBuffer(&commandBuffer, currentImage, 1);
+    /// posizione della pipeline nella chiave della renderQueue: il depth pre-pass prima di tutto, poi gli oggetti
+    /// opachi, lo skybox (disegnato a profondita' 1) per ultimo, cosi' il depth test scarta i suoi frammenti coperti
+    uint32_t pipelineSortOrder(const Pipeline *pipeline) const {
+        if (pipeline == &depthPrePassPipeline) {
+            return 0;
+        }
+        if (pipeline == &terrainPipeline || pipeline == &terrainEqualPipeline) {
+            return 1;
         }
+        return pipeline == &skyBoxPipeline ? 3 : 2;
+    }
 
-        //Pipeline for skybox
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                          skyBoxPipeline.graphicsPipeline);
+    uint32_t frameDrawCount() {
+        return static_cast<uint32_t>(drawCalls.size());
+    }
 
+    /// con il culling su GPU il render pass di CULL_PHASE_LATE ripete i disegni dei modelli con meshlet, ognuno con
+    /// i comandi della seconda fase, e disegna lo skybox dopo tutta la scena; gli altri modelli non vengono occlusi
+    /// e sono disegnati interi nel primo
+    bool drawnInPhase(const BaseModel *baseModel, CullPhase phase) const {
+        if (!gpuCulling.enabled) {
+            return phase == CULL_PHASE_EARLY;
+        }
+        if (baseModel == &skyboxBaseModel) {
+            return phase == CULL_PHASE_LATE;
+        }
+        return phase == CULL_PHASE_EARLY || baseModel->meshletDrawList.commandCount > 0;
+    }
 
-        skyboxBaseModel.populateCommandBuffer(&commandBuffer, currentImage, 0);
+    /// ogni parte disegna un intervallo dei drawCalls ordinati: pipeline, descriptor set comuni e buffer della
+    /// mesh vengono legati solo quando cambiano rispetto al disegno precedente della stessa parte
+    void populateCommandBufferPart(VkCommandBuffer commandBuffer, int currentImage, uint32_t part, uint32_t parts,
+                                   CullPhase phase) {
+        size_t begin = drawCalls.size() * part / parts;
+        size_t end = drawCalls.size() * (part + 1) / parts;
+        Pipeline *boundPipeline = nullptr;
+        /// i layout di terreno, drone e depth pre-pass sono compatibili: i set 0 e 2 restano legati quando si passa
+        /// dall'uno all'altro, e ogni oggetto lega il suo set 1 e i push constant con il layout della sua pipeline
+        bool sharedSetsBound = false;
+        const Model *boundModel = nullptr;
+        for (size_t i = begin; i < end; i++) {
+            BaseModel *baseModel = drawCalls[i].baseModel;
+            if (!drawnInPhase(baseModel, phase)) {
+                continue;
+            }
+            if (drawCalls[i].pipeline != boundPipeline) {
+                boundPipeline = drawCalls[i].pipeline;
+                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                  boundPipeline->graphicsPipeline);
+                /// lo skybox lega da se' il proprio set 0
+                if (boundPipeline == &skyBoxPipeline) {
+                    sharedSetsBound = false;
+                } else if (!sharedSetsBound) {
+                    sharedSetsBound = true;
+                    vkCmdBindDescriptorSets(commandBuffer,
+                                            VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                            boundPipeline->pipelineLayout, 0, 1,
+                                            &DS_global.descriptorSets[currentImage],
+                                            0, nullptr);
+                    vkCmdBindDescriptorSets(commandBuffer,
+                                            VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                            boundPipeline->pipelineLayout, 2, 1,
+                                            &DS_textures.descriptorSets[currentImage],
+                                            0, nullptr);
+                }
+            }
+            baseModel->populateCommandBuffer(&commandBuffer, currentImage, baseModel == &skyboxBaseModel ? 0 : 1,
+                                             baseModel->model.get() == boundModel, phase);
+            /// le mesh glTF cambiano i buffer legati a ogni primitiva
+            boundModel = baseModel->model->vertexFormat == VERTEX_STREAMS ? nullptr : baseModel->model.get();
+        }
     }
 
     // Here is where you update the uniforms.
@@ -184,6 +383,14 @@ protected:
 
         bool isAtLeastOneKeyPressed = false;
 
+        // P attiva e disattiva il depth pre-pass, una volta per pressione
+        int depthPrePassKey = glfwGetKey(window, GLFW_KEY_P);
+        if (depthPrePassKey == GLFW_PRESS && keys_status[GLFW_KEY_P] == GLFW_RELEASE) {
+            depthPrePass = !depthPrePass;
+            std::cout << "Depth pre-pass: " << (depthPrePass ? "on" : "off") << "\n";
+        }
+        keys_status[GLFW_KEY_P] = depthPrePassKey;
+
         keys_status[GLFW_KEY_A] = glfwGetKey(window, GLFW_KEY_A);
         keys_status[GLFW_KEY_S] = glfwGetKey(window, GLFW_KEY_S);
         keys_status[GLFW_KEY_D] = glfwGetKey(window, GLFW_KEY_D);
@@ -259,24 +466,105 @@ protected:
                                      0.1f, farPlane);
         gubo.proj[1][1] *= -1;
 
-        UniformBufferObject ubo{};
-        void *data;
-
-        vkMapMemory(device, DS_global.uniformBuffersMemory[0][currentImage], 0,
-                    sizeof(gubo), 0, &data);
-        memcpy(data, &gubo, sizeof(gubo));
-        vkUnmapMemory(device, DS_global.uniformBuffersMemory[0][currentImage]);
+        memcpy(DS_global.uniformBuffersMapped[0][currentImage], &gubo, sizeof(gubo));
 
         // Terrain
-        terrain.draw(currentImage, &ubo, &data, &device);
+        terrain.draw();
 
         // Drone
-        drone.draw(currentImage, &ubo, &data, &device);
+        drone.draw();
+
+        // Swarm: griglia quadrata di eliche che ruotano sopra il terreno
+        int swarmSide = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(SWARM_SIZE))));
+        for (int i = 0; i < static_cast<int>(swarm.size()); i++) {
+            glm::mat4 swarmMatrix = glm::translate(glm::mat4(1.0f),
+                                                   glm::vec3(2.0f * (i % swarmSide - swarmSide / 2), 5.0f,
+                                                             2.0f * (i / swarmSide - swarmSide / 2))) *
+                                    glm::rotate(glm::mat4(1.0f), time + i, glm::vec3(0, 1, 0));
+            swarm[i].setWorldMatrix(swarmMatrix);
+        }
+
+        sceneModels.clear();
+        sceneModels.push_back(&terrain.terrainBaseModel);
+        sceneModels.push_back(&drone.droneBaseModel);
+        for (auto &fanBaseModel: drone.fanBaseModelList) {
+            sceneModels.push_back(&fanBaseModel);
+        }
+        for (auto &swarmModel: swarm) {
+            sceneModels.push_back(&swarmModel);
+        }
+
+        glm::mat4 viewProj = gubo.proj * gubo.view;
+        drawList.clear();
+        if (gpuCulling.enabled) {
+            // il culling di oggetti e meshlet avviene nel compute shader: qui si scrivono solo le istanze
+            gpuCulling.beginFrame(currentImage, gubo.view, gubo.proj);
+            for (auto sceneModel: sceneModels) {
+                sceneModel->cullMeshlets(currentImage, viewProj, cameraPosition);
+                drawList.push_back(sceneModel);
+            }
+        } else {
+            // frustum culling degli oggetti con le worldMatrix appena calcolate: tutte le sfere in un solo test
+            glm::vec4 planes[6];
+            frustumPlanes(viewProj, planes);
+            sceneSpheres.resize(sceneModels.size());
+            sceneVisible.resize(sceneModels.size());
+            for (size_t i = 0; i < sceneModels.size(); i++) {
+                sceneSpheres[i] = sceneModels[i]->worldBoundingSphere();
+            }
+            cullSpheres(planes, sceneSpheres.data(), sceneSpheres.size(), sceneVisible.data());
+
+            // solo gli oggetti visibili passano al culling dei meshlet e vengono disegnati
+            for (size_t i = 0; i < sceneModels.size(); i++) {
+                if (sceneVisible[i]) {
+                    sceneModels[i]->cullMeshlets(currentImage, viewProj, cameraPosition);
+                    drawList.push_back(sceneModels[i]);
+                }
+            }
+        }
+        // lo skybox viene sempre disegnato
+        drawList.push_back(&skyboxBaseModel);
+
+        // con il depth pre-pass gli oggetti opachi vengono disegnati anche solo in profondita' e il terreno,
+        // lo shader piu' costoso, passa al confronto EQUAL
+        drawCalls.clear();
+        for (auto baseModel: drawList) {
+            Pipeline *pipeline = baseModel->pipeline;
+            if (depthPrePass && baseModel != &skyboxBaseModel &&
+                baseModel->model->vertexFormat == depthPrePassPipeline.vertexFormat) {
+                drawCalls.push_back({baseModel, &depthPrePassPipeline});
+                if (pipeline == &terrainPipeline) {
+                    pipeline = &terrainEqualPipeline;
+                }
+            }
+            drawCalls.push_back({baseModel, pipeline});
+        }
+
+        // ordine di disegno: pipeline, mesh condivisa, poi dal piu' vicino al piu' lontano
+        renderQueue.clear();
+        for (uint32_t i = 0; i < drawCalls.size(); i++) {
+            BaseModel *baseModel = drawCalls[i].baseModel;
+            glm::vec4 sphere = baseModel->worldBoundingSphere();
+            float depth = glm::length(glm::vec3(sphere) - cameraPosition) - sphere.w;
+            renderQueue.push(renderQueueKey(pipelineSortOrder(drawCalls[i].pipeline),
+                                            renderQueue.materialId(baseModel->model.get()), depth), i);
+        }
+        renderQueue.sort();
+        queuedCalls.clear();
+        for (const auto &item: renderQueue.items) {
+            queuedCalls.push_back(drawCalls[item.index]);
+        }
+        drawCalls.swap(queuedCalls);
+
+        // livelli di mip delle texture in streaming, prima quelli degli oggetti piu' vicini; anche per gli
+        // oggetti fuori dal frustum, che possono entrarvi appena la camera ruota
+        for (auto sceneModel: sceneModels) {
+            sceneModel->streamTexture(cameraPosition);
+        }
 
         // Skybox
         SkyBoxUniformBufferObject subo{};
 
-        void *dataSB;
         subo.view = cameraMatrix;
         subo.proj = glm::perspective(glm::radians(60.0f),
                                      swapChainExtent.width / (float) swapChainExtent.height,
@@ -293,7 +581,7 @@ protected:
 
 
         subo.proj[1][1] *= -1;
-        skyboxBaseModel.draw(currentImage, &subo, &dataSB, &device, worldMatrix);
+        skyboxBaseModel.draw(currentImage, &subo, worldMatrix);
     }
 
 };
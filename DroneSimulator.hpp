@@ -14,7 +14,16 @@
 #include <cstdint>
 #include <algorithm>
 #include <fstream>
+#include <sstream>
 #include <array>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <exception>
 
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEFAULT_ALIGNED_GENTYPES
@@ -22,6 +31,7 @@
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/packing.hpp>
 
 #include <chrono>
 
@@ -34,10 +44,70 @@
 
 #include <stb_image.h>
 
+#include "BakedTexture.hpp"
+#include "MipGenerator.hpp"
+#include "RenderQueue.hpp"
+
+/// frustum culling degli oggetti: 4 sfere per volta con SSE
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define FRUSTUM_CULLING_SSE
+#endif
+
+/// loader glTF/GLB: le immagini vengono decodificate in parallelo con stb_image e il salvataggio non serve
+#define TINYGLTF_IMPLEMENTATION
+#define TINYGLTF_NO_STB_IMAGE
+#define TINYGLTF_NO_STB_IMAGE_WRITE
+
+#include <tiny_gltf.h>
+
 //
 
 const int MAX_FRAMES_IN_FLIGHT = 2;
 
+/// dimensione del buffer di staging circolare condiviso da tutti gli upload
+const VkDeviceSize STAGING_RING_SIZE = 32 * 1024 * 1024;
+
+/// le texture 2D .dtex partono con i soli livelli fino a questa dimensione, gli altri arrivano in streaming
+const uint32_t TEXTURE_STREAMING_TAIL_SIZE = 64;
+/// byte di livelli di mip che lo streaming puo' caricare in tutta l'esecuzione. Non e' un budget di residenza: ogni
+/// texture alloca subito l'intera catena di mip e nessun livello viene mai scaricato, quindi non limita la VRAM ma
+/// solo il lavoro di lettura e upload; raggiunto il limite lo streaming si ferma fino alla chiusura
+const VkDeviceSize TEXTURE_STREAMING_UPLOAD_CAP = 64 * 1024 * 1024;
+/// entro questa distanza dalla camera un oggetto richiede il livello 0, ogni raddoppio ne toglie uno
+const float TEXTURE_STREAMING_FULL_DETAIL_DISTANCE = 20.0f;
+
+/// dimensione dei blocchi del DeviceMemoryAllocator; le risorse piu' grandi di meta' blocco hanno memoria dedicata
+const VkDeviceSize DEVICE_MEMORY_BLOCK_SIZE = 64 * 1024 * 1024;
+
+/// elementi dell'array di texture condiviso dagli oggetti (deve coincidere con gli shader)
+const uint32_t MAX_OBJECT_TEXTURES = 4;
+
+/// stampa ogni due secondi il tempo medio per frame e quello speso su CPU in updateUniformBuffer
+/// (per confrontare le ottimizzazioni sulla stessa scena)
+const bool FRAME_TIME_BENCHMARK = false;
+
+/// all'avvio confronta la generazione dei mip con il blit su GPU e su CPU e stampa i MB/s
+const bool MIPMAP_BENCHMARK = false;
+
+/// vertex e index buffer in memoria device-local, copiati dallo staging; falso = host-visible come prima
+/// (per confrontare i due percorsi con FRAME_TIME_BENCHMARK)
+const bool DEVICE_LOCAL_GEOMETRY = true;
+
+/// thread che registrano i command buffer secondari del frame (0 = tutti i core, 1 = registrazione nel primary)
+const unsigned COMMAND_RECORDING_THREADS = 4;
+/// disegni minimi per command buffer secondario: con meno disegni si usano meno parti, con una sola si registra
+/// direttamente nel primary
+const uint32_t MIN_DRAWS_PER_RECORDING_PART = 64;
+
+/// culling dei meshlet in un compute shader, con test di occlusione in due fasi: sulla profondita' del frame
+/// precedente e, per i meshlet scartati, su quella del frame in corso con un secondo render pass (richiede VK_KHR_draw_indirect_count, altrimenti resta il culling su CPU)
+const bool GPU_CULLING = true;
+
+/// depth pre-pass di terreno e drone prima del passaggio principale, in cui il terreno viene shadato solo dove la
+/// sua profondita' e' uguale a quella del pre-pass (attivabile a runtime con il tasto P)
+const bool DEPTH_PRE_PASS = true;
+
 // Lesson 22.0
 const std::vector<const char *> validationLayers = {
         "VK_LAYER_KHRONOS_validation"
@@ -87,6 +157,76 @@ struct Vertex {
     }
 };
 
+/// formato dei vertici usato da una pipeline: float a 32 bit, compresso (PackedVertex)
+/// oppure attributi in buffer separati, copiati cosi' come sono dai bufferView glTF
+enum VertexFormat {
+    VERTEX_FLOAT, VERTEX_PACKED, VERTEX_STREAMS
+};
+
+/// vertice compresso a 12 byte: posizione a 16 bit normalizzata rispetto al bounding box della mesh,
+/// normale in codifica ottaedrica a 8 bit e coordinate texture in half float
+struct PackedVertex {
+    uint16_t pos[3];
+    int8_t norm[2];
+    uint16_t texCoord[2];
+
+    static VkVertexInputBindingDescription getBindingDescription() {
+        VkVertexInputBindingDescription bindingDescription{};
+        bindingDescription.binding = 0;
+        bindingDescription.stride = sizeof(PackedVertex);
+        bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+        return bindingDescription;
+    }
+
+    static std::array<VkVertexInputAttributeDescription, 3>
+    getAttributeDescriptions() {
+        std::array<VkVertexInputAttributeDescription, 3>
+                attributeDescriptions{};
+
+        /// il quarto componente letto dallo shader contiene la normale e viene ignorato
+        attributeDescriptions[0].binding = 0;
+        attributeDescriptions[0].location = 0;
+        attributeDescriptions[0].format = VK_FORMAT_R16G16B16A16_UNORM;
+        attributeDescriptions[0].offset = offsetof(PackedVertex, pos);
+
+        attributeDescriptions[1].binding = 0;
+        attributeDescriptions[1].location = 1;
+        attributeDescriptions[1].format = VK_FORMAT_R8G8_SNORM;
+        attributeDescriptions[1].offset = offsetof(PackedVertex, norm);
+
+        attributeDescriptions[2].binding = 0;
+        attributeDescriptions[2].location = 2;
+        attributeDescriptions[2].format = VK_FORMAT_R16G16_SFLOAT;
+        attributeDescriptions[2].offset = offsetof(PackedVertex, texCoord);
+
+        return attributeDescriptions;
+    }
+
+    static PackedVertex pack(const Vertex &v, glm::vec3 boundsMin, glm::vec3 boundsExtent) {
+        PackedVertex packedVertex{};
+        glm::vec3 p = glm::clamp((v.pos - boundsMin) / boundsExtent, 0.0f, 1.0f);
+        for (int i = 0; i < 3; i++) {
+            packedVertex.pos[i] = glm::packUnorm1x16(p[i]);
+        }
+
+        // proiezione della normale sull'ottaedro e ripiegamento dell'emisfero inferiore
+        glm::vec3 n = v.norm / (std::abs(v.norm.x) + std::abs(v.norm.y) + std::abs(v.norm.z) + 1e-12f);
+        glm::vec2 oct = glm::vec2(n.x, n.y);
+        if (n.z < 0.0f) {
+            oct = (1.0f - glm::abs(glm::vec2(n.y, n.x))) *
+                  glm::vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+        }
+        packedVertex.norm[0] = static_cast<int8_t>(glm::packSnorm1x8(oct.x));
+        packedVertex.norm[1] = static_cast<int8_t>(glm::packSnorm1x8(oct.y));
+
+        packedVertex.texCoord[0] = glm::packHalf1x16(v.texCoord.x);
+        packedVertex.texCoord[1] = glm::packHalf1x16(v.texCoord.y);
+
+        return packedVertex;
+    }
+};
+
 
 // Lesson 13
 struct QueueFamilyIndices {
@@ -183,36 +323,377 @@ void PrintVkError(VkResult result) {
 
 class BaseProject;
 
+/// primitiva glTF disegnata con VERTEX_STREAMS: offset degli attributi e degli indici dentro vertexBuffer
+struct SubMesh {
+    VkDeviceSize posOffset;
+    VkDeviceSize normOffset;
+    VkDeviceSize uvOffset;
+    VkDeviceSize indexOffset;
+    uint32_t indexCount;
+    VkIndexType indexType;
+    /// immagine glTF del base color del materiale, -1 se il materiale non ne ha una
+    int image;
+};
+
+/// gruppo di triangoli consecutivi nell'index buffer, con sfera e cono delle normali per il culling su CPU
+struct Meshlet {
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    glm::vec3 center;
+    float radius;
+    glm::vec3 coneAxis;
+    float coneCutoff;
+};
+
+const uint32_t MESHLET_MIN_TRIANGLES = 64;
+const uint32_t MESHLET_MAX_TRIANGLES = 128;
+
+/// piani del frustum estratti dalle righe della matrice view-projection (depth 0..1), normalizzati e
+/// orientati verso l'interno
+inline void frustumPlanes(const glm::mat4 &viewProj, glm::vec4 planes[6]) {
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; i++) {
+        rows[i] = glm::vec4(viewProj[0][i], viewProj[1][i], viewProj[2][i], viewProj[3][i]);
+    }
+    planes[0] = rows[3] + rows[0];
+    planes[1] = rows[3] - rows[0];
+    planes[2] = rows[3] + rows[1];
+    planes[3] = rows[3] - rows[1];
+    planes[4] = rows[2];
+    planes[5] = rows[3] - rows[2];
+    for (int i = 0; i < 6; i++) {
+        planes[i] /= glm::length(glm::vec3(planes[i]));
+    }
+}
+
+/// visible[i] = 1 se la sfera i (centro in xyz, raggio in w) non e' completamente fuori da uno dei piani
+inline void cullSpheres(const glm::vec4 planes[6], const glm::vec4 *spheres, size_t count,
+                        unsigned char *visible) {
+    size_t i = 0;
+#ifdef FRUSTUM_CULLING_SSE
+    /// le 4 sfere vengono trasposte in x, y, z, raggio: un piano si testa con 3 moltiplicazioni e un confronto
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_loadu_ps(&spheres[i].x);
+        __m128 y = _mm_loadu_ps(&spheres[i + 1].x);
+        __m128 z = _mm_loadu_ps(&spheres[i + 2].x);
+        __m128 radius = _mm_loadu_ps(&spheres[i + 3].x);
+        _MM_TRANSPOSE4_PS(x, y, z, radius);
+        __m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), radius);
+        __m128 inside = _mm_cmpeq_ps(x, x);
+        for (int p = 0; p < 6; p++) {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(planes[p].x)),
+                                                    _mm_mul_ps(y, _mm_set1_ps(planes[p].y))),
+                                         _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(planes[p].z)),
+                                                    _mm_set1_ps(planes[p].w)));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negativeRadius));
+        }
+        int mask = _mm_movemask_ps(inside);
+        for (int k = 0; k < 4; k++) {
+            visible[i + k] = static_cast<unsigned char>((mask >> k) & 1);
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        visible[i] = 1;
+        for (int p = 0; p < 6; p++) {
+            if (glm::dot(glm::vec3(planes[p]), glm::vec3(spheres[i])) + planes[p].w < -spheres[i].w) {
+                visible[i] = 0;
+                break;
+            }
+        }
+    }
+}
+
+/// blocco di memoria del DeviceMemoryAllocator: gli intervalli liberi sono ordinati per offset e vengono fusi con
+/// i vicini quando una risorsa viene liberata. Un blocco dedicato contiene una sola risorsa
+struct MemoryBlock {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize size = 0;
+    uint32_t memoryType = 0;
+    /// buffer e immagini optimal stanno in blocchi diversi, cosi' due risorse vicine non possono violare
+    /// bufferImageGranularity
+    bool linear = true;
+    bool dedicated = false;
+    std::map<VkDeviceSize, VkDeviceSize> freeRanges;
+    uint32_t allocationCount = 0;
+    /// un VkDeviceMemory si mappa una volta sola: il blocco resta mappato finche' qualche risorsa lo usa
+    void *mapped = nullptr;
+    uint32_t mapCount = 0;
+};
+
+/// memoria assegnata a una risorsa: un intervallo di un blocco condiviso o un blocco dedicato
+struct MemoryAllocation {
+    MemoryBlock *block = nullptr;
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+};
+
+/// sotto-allocatore della memoria di buffer e immagini: pochi vkAllocateMemory da DEVICE_MEMORY_BLOCK_SIZE per tipo
+/// di memoria invece di uno per risorsa. Thread-safe, perche' lo staging dedicato viene allocato anche dal
+/// thread dello streaming. I blocchi vuoti restano allocati fino a cleanup() per essere riusati
+struct DeviceMemoryAllocator {
+    BaseProject *BP = nullptr;
+    VkDeviceSize bufferImageGranularity = 1;
+    std::vector<std::unique_ptr<MemoryBlock>> blocks;
+    std::mutex mutex;
+
+    void init(BaseProject *bp);
+
+    MemoryAllocation allocate(const VkMemoryRequirements &requirements, VkMemoryPropertyFlags properties,
+                              bool linear);
+
+    void free(MemoryAllocation &allocation);
+
+    void *map(const MemoryAllocation &allocation);
+
+    void unmap(const MemoryAllocation &allocation);
+
+    void cleanup();
+};
+
 struct Model {
-    BaseProject *BP;
+    BaseProject *BP = nullptr;
     std::vector<Vertex> vertices;
     std::vector<uint32_t> indices;
-    VkBuffer vertexBuffer;
-    VkDeviceMemory vertexBufferMemory;
-    VkBuffer indexBuffer;
-    VkDeviceMemory indexBufferMemory;
+    VkBuffer vertexBuffer = VK_NULL_HANDLE;
+    MemoryAllocation vertexBufferMemory;
+    VkBuffer indexBuffer = VK_NULL_HANDLE;
+    MemoryAllocation indexBufferMemory;
+    VertexFormat vertexFormat = VERTEX_FLOAT;
+    VkIndexType indexType = VK_INDEX_TYPE_UINT32;
+    glm::vec3 boundsMin = glm::vec3(0.0f);
+    glm::vec3 boundsMax = glm::vec3(0.0f);
+    /// sfera che contiene la mesh, centrata nel box, per il frustum culling degli oggetti
+    glm::vec3 boundsCenter = glm::vec3(0.0f);
+    float boundsRadius = 0.0f;
+    /// parametri di decompressione delle posizioni passati allo shader (identita' per VERTEX_FLOAT)
+    glm::vec4 posOffset = glm::vec4(0.0f);
+    glm::vec4 posScale = glm::vec4(1.0f);
+
+    /// dati glTF: primitive, buffer binari da copiare senza conversione e immagini gia' decodificate in RGBA8
+    std::vector<SubMesh> subMeshes;
+    std::vector<std::vector<unsigned char>> streamBuffers;
+    std::vector<VkDeviceSize> streamBufferOffsets;
+    std::vector<tinygltf::Image> images;
+    int baseColorImage = -1;
+
+    std::vector<Meshlet> meshlets;
+
+    /// content: file gia' letto (es. da AssetCache per calcolarne l'hash), se vuoto viene letto da disco
+    void load(std::string file, std::vector<char> content = {});
+
+    void loadModel(std::string file, const std::vector<char> &content);
+
+    void loadGLTF(std::string file, const std::vector<char> &content);
 
-    void loadModel(std::string file);
+    void createStreamBuffer();
+
+    void createMeshlets();
+
+    uint32_t cullMeshlets(VkDrawIndexedIndirectCommand *commands, const glm::mat4 &worldMatrix,
+                          const glm::mat4 &viewProj, glm::vec3 cameraPosition) const;
 
     void createIndexBuffer();
 
     void createVertexBuffer();
 
-    void init(BaseProject *bp, std::string file);
+    void init(BaseProject *bp, std::string file, VertexFormat format = VERTEX_FLOAT);
 
     void cleanup();
 };
 
-struct Texture {
+/// fase del culling su GPU: la prima usa la piramide di profondita' del frame precedente, la seconda riprova i
+/// meshlet occlusi contro quella costruita dai disegni della prima e li disegna in un secondo render pass
+enum CullPhase {
+    CULL_PHASE_EARLY, CULL_PHASE_LATE
+};
+
+/// comandi di disegno indiretti di una istanza di un Model, riscritti a ogni frame dal culling dei meshlet
+/// nell'intervallo riservato nell'IndirectDrawBuffer. Separati dal Model perche' ogni istanza ha la sua worldMatrix
+struct MeshletDrawList {
     BaseProject *BP;
+    const Model *model = nullptr;
+    /// 0 se la mesh non ha meshlet: il BaseModel disegna allora l'intera mesh
+    uint32_t commandCount = 0;
+    uint32_t firstCommand = 0;
+    uint32_t countIndex = 0;
+    /// comandi visibili dopo il culling, per immagine della swap chain
+    std::vector<uint32_t> drawCounts;
+
+    void init(BaseProject *bp, const Model *m);
+
+    void cull(uint32_t currentImage, const glm::mat4 &worldMatrix, const glm::mat4 &viewProj,
+              glm::vec3 cameraPosition);
+
+    void draw(VkCommandBuffer commandBuffer, uint32_t currentImage, CullPhase phase = CULL_PHASE_EARLY);
+
+    void cleanup();
+};
+
+/// comandi indiretti di tutti gli oggetti in un solo buffer per immagine della swap chain, mappato una volta.
+/// Ogni MeshletDrawList riserva in init() un intervallo di comandi e un contatore; il buffer viene creato dopo
+/// localInit, quando la dimensione e' nota. I contatori seguono i comandi e sono letti da
+/// vkCmdDrawIndexedIndirectCountKHR, cosi' il numero di comandi non deve essere noto alla registrazione.
+/// Con il culling su GPU comandi e contatori sono duplicati: la seconda copia e' quella di CULL_PHASE_LATE
+struct IndirectDrawBuffer {
+    BaseProject *BP = nullptr;
+    uint32_t reservedCommands = 0;
+    uint32_t reservedCounts = 0;
+    /// 2 con il culling su GPU, altrimenti 1
+    uint32_t phases = 1;
+    std::vector<VkBuffer> buffers;
+    std::vector<MemoryAllocation> buffersMemory;
+    std::vector<VkDrawIndexedIndirectCommand *> commands;
+    std::vector<uint32_t *> counts;
+    /// liste che hanno riservato un intervallo, nell'ordine dei comandi: GpuCulling ne copia i meshlet
+    std::vector<MeshletDrawList *> drawLists;
+
+    void init(BaseProject *bp);
+
+    uint32_t reserveCommands(uint32_t commandCount);
+
+    uint32_t reserveCount();
+
+    void create();
+
+    VkDeviceSize countOffset(uint32_t countIndex) const;
+
+    /// comandi e contatore di una MeshletDrawList nella copia della fase
+    VkDeviceSize commandOffset(const MeshletDrawList &drawList, CullPhase phase) const;
+
+    VkDeviceSize countOffset(const MeshletDrawList &drawList, CullPhase phase) const;
+
+    void cleanup();
+};
+
+/// porzione mappata dello staging ring (o, se troppo grande, un buffer dedicato con la sua memoria)
+struct StagingAllocation {
+    VkBuffer buffer = VK_NULL_HANDLE;
+    MemoryAllocation memory;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    void *data = nullptr;
+};
+
+/// upload di un'immagine: copia dallo staging (una regione per livello o faccia) ed eventuale generazione dei mip
+struct ImageUpload {
+    VkImage image;
+    VkFormat format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t mipLevels;
+    uint32_t layerCount;
+    StagingAllocation staging;
+    std::vector<VkBufferImageCopy> regions;
+    /// se vero i livelli dopo il primo vengono ottenuti con blit successivi
+    bool generateMipmaps;
+    /// l'upload riguarda i livelli da baseMipLevel a mipLevels - 1, che si trovano in oldLayout
+    uint32_t baseMipLevel = 0;
+    VkImageLayout oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+};
+
+/// regione che copia il livello 0 di tutte le facce, disposte una dopo l'altra a partire da bufferOffset
+inline VkBufferImageCopy imageCopyRegion(VkDeviceSize bufferOffset, int width, int height, uint32_t layerCount) {
+    VkBufferImageCopy region{};
+    region.bufferOffset = bufferOffset;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = layerCount;
+    region.imageOffset = {0, 0, 0};
+    region.imageExtent = {static_cast<uint32_t>(width), static_cast<uint32_t>(height), 1};
+    return region;
+}
+
+/// upload di un buffer device-local: una copia dallo staging, visibile al vertex input dopo la barriera
+struct BufferUpload {
+    VkBuffer buffer;
+    StagingAllocation staging;
+    VkDeviceSize size;
+};
+
+/// raccoglie gli upload di piu' risorse e li registra tutti in un command buffer con barriere accorpate:
+/// una per portare tutte le immagini in TRANSFER_DST, una per livello di mip generato e una finale verso
+/// SHADER_READ_ONLY. submit() invia una sola volta e non attende: il fence si puo' interrogare con isComplete()
+struct UploadBatch {
+    BaseProject *BP = nullptr;
+    bool recording = false;
+    std::vector<ImageUpload> images;
+    std::vector<BufferUpload> buffers;
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    VkFence fence = VK_NULL_HANDLE;
+    /// staging in uso da parte del batch inviato, rilasciato quando il fence e' segnalato
+    std::vector<StagingAllocation> stagingInFlight;
+
+    void begin(BaseProject *bp);
+
+    void uploadImage(ImageUpload upload);
+
+    void uploadBuffer(BufferUpload upload);
+
+    void submit();
+
+    bool isComplete();
+
+    void wait();
+
+    void recordImageUploads();
+
+    void recordBufferUploads();
+
+    void retire();
+};
+
+struct Texture {
+    BaseProject *BP = nullptr;
     uint32_t mipLevels;
-    VkImage textureImage;
-    VkDeviceMemory textureImageMemory;
+    VkFormat format = VK_FORMAT_R8G8B8A8_SRGB;
+    VkImage textureImage = VK_NULL_HANDLE;
+    MemoryAllocation textureImageMemory;
     VkImageView textureImageView;
     VkSampler textureSampler;
 
+    /// pixel RGBA8 decodificati da decode() (una faccia per immagine), liberati dopo l'upload
+    std::vector<stbi_uc *> decodedPixels;
+    int decodedWidth = 0;
+    int decodedHeight = 0;
+    /// staging gia' riempito da loadCubic() o loadBaked(), consumato alla creazione dell'immagine
+    StagingAllocation pendingStaging;
+    /// contenitore .dtex: una regione di copia per livello di mip, tutte le facce insieme
+    std::vector<VkBufferImageCopy> bakedRegions;
+    uint32_t bakedLayers = 1;
+    /// streaming dei livelli di mip: il file e gli offset servono per leggere i livelli mancanti in seguito
+    std::string bakedFile;
+    std::vector<BakedTextureLevel> bakedLevels;
+    /// primo livello di mip caricato: i shader non campionano sotto questo livello
+    uint32_t residentLevel = 0;
+    /// vero mentre il livello residentLevel - 1 e' in caricamento
+    bool streamingLevel = false;
+    /// lettura di un livello fallita: la texture resta ai livelli gia' caricati
+    bool streamingFailed = false;
+
+    /// contents: file gia' letti, uno per percorso (vuoto se va letto da disco)
+    void load(BaseProject *bp, std::vector<std::string> files, std::vector<std::vector<char>> contents = {});
+
+    void decode(std::vector<std::string> files, std::vector<std::vector<char>> contents = {});
+
+    void loadCubic(std::vector<std::string> files, std::vector<std::vector<char>> contents = {});
+
+    bool loadBaked(const std::string &file);
+
+    void createBakedTextureImage();
+
+    StagingAllocation readBakedLevel(uint32_t level);
+
+    void freeDecodedPixels();
+
     void createTextureImage(std::string file);
 
+    void createTextureImage(const unsigned char *pixels, int texWidth, int texHeight);
+
     void createTextureImageView();
 
     void createSkyBoxTextureImageView();
@@ -223,15 +704,100 @@ struct Texture {
 
     void init(BaseProject *bp, std::string file);
 
+    void initFromPixels(BaseProject *bp, const unsigned char *pixels, int width, int height);
+
     void initSkyBox(BaseProject *bp, std::vector<std::string> files);
 
     void cleanup();
 };
 
+/// carica su un thread separato i livelli di mip piu' grandi delle texture .dtex, partendo da quelle
+/// degli oggetti piu' vicini alla camera; i livelli letti vengono inviati alla GPU dal thread principale
+struct TextureStreamer {
+    struct Request {
+        Texture *texture;
+        uint32_t level;
+        float distance;
+    };
+
+    BaseProject *BP = nullptr;
+    /// richieste del frame corrente, una per texture
+    std::vector<Request> frameRequests;
+    /// livelli gia' caricati (mai sottratti) e in caricamento, confrontati con TEXTURE_STREAMING_UPLOAD_CAP
+    VkDeviceSize uploadedBytes = 0;
+    VkDeviceSize inFlightBytes = 0;
+    UploadBatch batch;
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    bool stopping = false;
+    /// da leggere, ordinate per distanza
+    std::deque<Request> pending;
+    /// gia' letti nello staging, in attesa di upload
+    std::vector<std::pair<Request, StagingAllocation>> loaded;
+    /// letture fallite, i loro byte vengono tolti da inFlightBytes in update()
+    std::vector<Request> failed;
+
+    void init(BaseProject *bp);
+
+    void request(Texture *texture, float distance);
+
+    void update();
+
+    void run();
+
+    void cleanup();
+};
+
+/// registra la scena in command buffer secondari su piu' thread: il thread principale registra la parte 0,
+/// i worker le altre. Ogni thread ha un proprio command pool per frame in flight, perche' un pool non puo'
+/// essere usato da due thread contemporaneamente
+struct CommandRecorder {
+    BaseProject *BP = nullptr;
+    uint32_t threadCount = 1;
+    /// [frame in flight * threadCount + thread]
+    std::vector<VkCommandPool> commandPools;
+    std::vector<VkCommandBuffer> commandBuffers;
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    std::condition_variable finished;
+    bool stopping = false;
+    /// incrementato ad ogni frame da registrare, i worker ripartono quando cambia
+    uint64_t generation = 0;
+    uint32_t running = 0;
+    bool failed = false;
+    /// prima eccezione lanciata da un worker, rilanciata dal thread principale in record()
+    std::exception_ptr error;
+    uint32_t frame = 0;
+    uint32_t imageIndex = 0;
+    /// parti registrate nel frame corrente, al massimo threadCount
+    uint32_t parts = 1;
+
+    void init(BaseProject *bp, unsigned threads);
+
+    /// numero di parti per `draws` disegni: 1 significa registrare nel primary
+    uint32_t partCount(uint32_t draws) const;
+
+    /// registra `partsToRecord` parti e le esegue nel primary, che deve avere il render pass aperto con
+    /// VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
+    void record(VkCommandBuffer primary, uint32_t currentFrame, uint32_t currentImage, uint32_t partsToRecord);
+
+    bool recordPart(uint32_t part);
+
+    void run(uint32_t part);
+
+    void cleanup();
+};
+
 struct DescriptorSetLayoutBinding {
     uint32_t binding;
     VkDescriptorType type;
     VkShaderStageFlags flags;
+    /// maggiore di 1 per gli array di descrittori
+    uint32_t count = 1;
 };
 
 
@@ -244,13 +810,25 @@ struct DescriptorSetLayout {
     void cleanup();
 };
 
+/// uso del depth buffer di una pipeline. DEPTH_PREPASS scrive solo la profondita' (solo la posizione come
+/// attributo, nessun fragment shader, colore non scritto); DEPTH_EQUAL disegna solo i frammenti che hanno
+/// esattamente la profondita' lasciata dal pre-pass, senza riscriverla
+enum PipelineDepthMode {
+    DEPTH_WRITE, DEPTH_PREPASS, DEPTH_EQUAL
+};
+
 struct Pipeline {
     BaseProject *BP;
     VkPipeline graphicsPipeline;
     VkPipelineLayout pipelineLayout;
+    VertexFormat vertexFormat = VERTEX_FLOAT;
 
+    /// pushConstantsSize: byte di push constant visibili a vertex e fragment shader (0 = nessuno).
+    /// Con DEPTH_PREPASS FragShader e' vuoto
     void init(BaseProject *bp, const std::string &VertShader, const std::string &FragShader,
-              std::vector<DescriptorSetLayout *> D, bool first, bool isSkyBox);
+              std::vector<DescriptorSetLayout *> D, bool first, bool isSkyBox,
+              VertexFormat format = VERTEX_FLOAT, uint32_t pushConstantsSize = 0,
+              PipelineDepthMode depthMode = DEPTH_WRITE);
 
     VkShaderModule createShaderModule(const std::vector<char> &code);
 
@@ -260,7 +838,7 @@ struct Pipeline {
 };
 
 enum DescriptorSetElementType {
-    UNIFORM, TEXTURE
+    UNIFORM, TEXTURE, TEXTURE_ARRAY, UNIFORM_DYNAMIC
 };
 
 struct DescriptorSetElement {
@@ -268,28 +846,205 @@ struct DescriptorSetElement {
     DescriptorSetElementType type;
     int size;
     Texture *tex;
+    /// TEXTURE_ARRAY: una texture per elemento dell'array
+    std::vector<Texture *> textures = {};
+    /// UNIFORM_DYNAMIC: numero di blocchi da size byte (uno per oggetto) nello stesso buffer
+    uint32_t count = 1;
 };
 
 struct DescriptorSet {
     BaseProject *BP;
 
     std::vector<std::vector<VkBuffer>> uniformBuffers;
-    std::vector<std::vector<VkDeviceMemory>> uniformBuffersMemory;
+    std::vector<std::vector<MemoryAllocation>> uniformBuffersMemory;
+    /// uniform buffer mappati una volta alla creazione: gli aggiornamenti per frame sono semplici memcpy
+    std::vector<std::vector<void *>> uniformBuffersMapped;
     std::vector<VkDescriptorSet> descriptorSets;
 
     std::vector<bool> toFree;
 
+    /// UNIFORM_DYNAMIC: distanza tra i blocchi (allineata a minUniformBufferOffsetAlignment), blocchi e blocchi assegnati
+    VkDeviceSize dynamicStride = 0;
+    uint32_t dynamicCount = 0;
+    uint32_t dynamicUsed = 0;
+
     void init(BaseProject *bp, DescriptorSetLayout *L,
               std::vector<DescriptorSetElement> E);
 
+    uint32_t allocateDynamicOffset();
+
+    void cleanup();
+};
+
+/// meshlet letto dal compute shader di culling (layout std430 di cullMeshlets.comp)
+struct GpuMeshlet {
+    /// centro e raggio in coordinate del modello
+    glm::vec4 sphere;
+    /// asse e cutoff del cono delle normali
+    glm::vec4 cone;
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    /// countIndex della MeshletDrawList, indice del GpuCullObject
+    uint32_t object;
+    uint32_t firstInObject;
+};
+
+static_assert(sizeof(GpuMeshlet) == 48, "GpuMeshlet must match the std430 layout of cullMeshlets.comp");
+
+/// istanza di un Model nel frame, scritta da MeshletDrawList::cull
+struct GpuCullObject {
+    glm::mat4 world;
+    /// bounding sphere in coordinate mondo; raggio negativo se l'oggetto non e' stato aggiornato nel frame
+    glm::vec4 sphere;
+    /// camera in coordinate del modello per il test del cono, in w la scala massima della worldMatrix
+    glm::vec4 eye;
+    uint32_t firstCommand;
+    uint32_t countIndex;
+    uint32_t pad[2];
+};
+
+static_assert(sizeof(GpuCullObject) == 112, "GpuCullObject must match the std430 layout of cullMeshlets.comp");
+
+/// intestazione del buffer del frame, seguita da un GpuCullObject per ogni contatore dell'IndirectDrawBuffer
+struct GpuCullFrame {
+    glm::vec4 planes[6];
+    /// camera del frame che ha prodotto la piramide letta da CULL_PHASE_EARLY
+    glm::mat4 previousView;
+    glm::mat4 previousProj;
+    /// camera del frame, con cui CULL_PHASE_LATE legge la piramide appena ricostruita
+    glm::mat4 view;
+    glm::mat4 proj;
+    /// dimensione del livello 0, numero di livelli, 1 se la piramide del frame precedente e' valida
+    glm::vec4 pyramid;
+    uint32_t objectCount;
+    uint32_t meshletCount;
+    /// comandi riservati nell'IndirectDrawBuffer: i comandi di CULL_PHASE_LATE seguono quelli della prima fase
+    uint32_t commandCount;
+    uint32_t pad0;
+    /// statistiche incrementate dal compute shader, lette quando l'immagine torna libera
+    uint32_t objectsCulled;
+    uint32_t meshletsDrawn;
+    uint32_t meshletsOccluded;
+    /// meshlet scartati dalla prima fase e disegnati dalla seconda (inclusi in meshletsDrawn)
+    uint32_t meshletsLate;
+};
+
+static_assert(sizeof(GpuCullFrame) == 400, "GpuCullFrame must match the std430 layout of cullMeshlets.comp");
+
+/// culling dei meshlet su GPU in due fasi. Prima del render pass un thread per meshlet testa l'oggetto e il
+/// meshlet contro il frustum, il cono delle normali e la piramide di profondita' del frame precedente, e scrive i
+/// comandi visibili nell'intervallo della MeshletDrawList dell'IndirectDrawBuffer incrementandone il contatore.
+/// Dopo il primo render pass la piramide (profondita' massima per regione, un livello per mip) viene ricostruita
+/// dal depth buffer; la seconda fase riprova contro di essa, con la camera del frame, i soli meshlet che la prima
+/// ha scartato per occlusione, e quelli visibili vengono disegnati in un secondo render pass. Cosi' un oggetto che
+/// si muove o che viene scoperto non sparisce per un frame quando la piramide vecchia non e' piu' valida
+struct GpuCulling {
+    BaseProject *BP = nullptr;
+    /// falso senza VK_KHR_draw_indirect_count o senza un depth buffer campionabile
+    bool enabled = false;
+    DescriptorSetLayout cullSetLayout;
+    DescriptorSetLayout pyramidSetLayout;
+    VkPipelineLayout cullPipelineLayout = VK_NULL_HANDLE;
+    VkPipelineLayout pyramidPipelineLayout = VK_NULL_HANDLE;
+    VkPipeline cullPipeline = VK_NULL_HANDLE;
+    VkPipeline pyramidPipeline = VK_NULL_HANDLE;
+    VkSampler sampler = VK_NULL_HANDLE;
+
+    /// risorse che dipendono dalla swap chain e dai comandi riservati, ricreate da create()
+    VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+    /// uno per immagine della swap chain
+    std::vector<VkDescriptorSet> cullSets;
+    /// uno per livello della piramide
+    std::vector<VkDescriptorSet> pyramidSets;
+    uint32_t meshletCount = 0;
+    VkBuffer meshletBuffer = VK_NULL_HANDLE;
+    MemoryAllocation meshletBufferMemory;
+    std::vector<VkBuffer> frameBuffers;
+    std::vector<MemoryAllocation> frameBuffersMemory;
+    std::vector<GpuCullFrame *> frames;
+    /// per immagine, un flag per meshlet scritto dalla prima fase: 1 se il meshlet e' stato scartato solo perche'
+    /// occluso e va riprovato dalla seconda
+    std::vector<VkBuffer> retestBuffers;
+    std::vector<MemoryAllocation> retestBuffersMemory;
+
+    VkImage pyramidImage = VK_NULL_HANDLE;
+    MemoryAllocation pyramidImageMemory;
+    VkImageView pyramidView = VK_NULL_HANDLE;
+    std::vector<VkImageView> pyramidLevelViews;
+    uint32_t pyramidWidth = 0;
+    uint32_t pyramidHeight = 0;
+    uint32_t pyramidLevels = 0;
+    bool pyramidReady = false;
+    glm::mat4 previousView = glm::mat4(1.0f);
+    glm::mat4 previousProj = glm::mat4(1.0f);
+
+    /// totali letti dai frame completati, azzerati dal report di FRAME_TIME_BENCHMARK
+    uint64_t statsFrames = 0;
+    uint64_t objectsCulled = 0;
+    uint64_t meshletsDrawn = 0;
+    uint64_t meshletsOccluded = 0;
+    uint64_t meshletsLate = 0;
+
+    void init(BaseProject *bp);
+
+    void createPipeline(const std::string &file, VkDescriptorSetLayout setLayout, uint32_t pushConstantsSize,
+                        VkPipelineLayout &pipelineLayout, VkPipeline &pipeline);
+
+    /// dopo IndirectDrawBuffer::create(), quando tutte le MeshletDrawList hanno riservato i loro comandi
+    void create();
+
+    /// legge le statistiche dell'ultimo uso dell'immagine e prepara il buffer del frame
+    void beginFrame(uint32_t currentImage, const glm::mat4 &view, const glm::mat4 &proj);
+
+    void setObject(uint32_t currentImage, const MeshletDrawList &drawList, const glm::mat4 &worldMatrix,
+                   glm::vec3 cameraPosition);
+
+    /// fuori dal render pass: CULL_PHASE_EARLY prima del primo, CULL_PHASE_LATE dopo recordDepthPyramid
+    void recordCull(VkCommandBuffer commandBuffer, uint32_t currentImage, CullPhase phase);
+
+    /// dopo la chiusura del primo render pass
+    void recordDepthPyramid(VkCommandBuffer commandBuffer);
+
+    void destroy();
+
     void cleanup();
 };
 
+/// cache degli asset indicizzata dal contenuto dei file: richieste uguali (anche da percorsi diversi)
+/// condividono lo stesso Model o Texture e quindi un solo upload. Le risorse non piu' referenziate
+/// vengono liberate da collect(); la cache sopravvive alla ricreazione della swap chain
+struct AssetCache {
+    template<typename T>
+    struct Entry {
+        std::once_flag loaded;
+        std::shared_ptr<T> asset = std::make_shared<T>();
+    };
+
+    std::mutex mutex;
+    std::map<std::string, uint64_t> fileHashes;
+    std::map<uint64_t, std::shared_ptr<Entry<Model>>> models;
+    std::map<uint64_t, std::shared_ptr<Entry<Texture>>> textures;
+
+    /// contents, se passato, riceve il contenuto letto per l'hash (vuoto per i file con hash gia' in memoria)
+    uint64_t hashFiles(const std::vector<std::string> &files, std::vector<std::vector<char>> *contents = nullptr);
+
+    std::shared_ptr<Model> loadModel(const std::string &file);
+
+    std::shared_ptr<Texture> loadTexture(BaseProject *bp, const std::vector<std::string> &files);
+
+    /// image: indice dell'immagine incorporata nel file glTF
+    std::shared_ptr<Texture> embeddedTexture(const std::string &modelFile, int image);
+
+    void collect();
+};
+
 
 // MAIN ! 
 class BaseProject {
     friend class Model;
 
+    friend class MeshletDrawList;
+
     friend class Texture;
 
     friend class Pipeline;
@@ -298,7 +1053,26 @@ class BaseProject {
 
     friend class DescriptorSet;
 
+    friend class UploadBatch;
+
+    friend class TextureStreamer;
+
+    friend class DeviceMemoryAllocator;
+
+    friend class CommandRecorder;
+
+    friend class IndirectDrawBuffer;
+
+    friend class GpuCulling;
+
 public:
+    /// condivisa da tutti i BaseModel, svuotata in localCleanup
+    AssetCache assetCache;
+    /// i BaseModel richiedono i livelli di mip mancanti a ogni frame in base alla distanza dalla camera
+    TextureStreamer textureStreamer;
+    /// memoria di tutti i buffer e le immagini, vedi createBuffer e createImage
+    DeviceMemoryAllocator memoryAllocator;
+
     virtual void setWindowParameters() = 0;
 
     void run() {
@@ -315,6 +1089,8 @@ protected:
     std::string windowTitle;
     VkClearColorValue initialBackgroundColor;
     int uniformBlocksInPool;
+    /// uniform buffer dinamici: uno per gruppo di oggetti, indipendente dal numero di oggetti
+    int dynamicUniformBlocksInPool = 0;
     int texturesInPool;
     int setsInPool;
 
@@ -329,7 +1105,57 @@ protected:
     VkQueue graphicsQueue;
     VkQueue presentQueue;
     VkCommandPool commandPool;
+    /// se falso ogni comando indiretto viene registrato con una chiamata separata
+    bool multiDrawIndirect = false;
+    /// VK_KHR_draw_indirect_count: il numero di comandi indiretti viene letto da un buffer
+    bool drawIndirectCount = false;
+    PFN_vkCmdDrawIndexedIndirectCountKHR cmdDrawIndexedIndirectCount = nullptr;
+    /// comandi indiretti del frame di tutti gli oggetti
+    IndirectDrawBuffer indirectDrawBuffer;
+    /// se abilitato riempie indirectDrawBuffer al posto del culling su CPU
+    GpuCulling gpuCulling;
+    /// stato corrente del depth pre-pass, letto da localInit e updateUniformBuffer
+    bool depthPrePass = DEPTH_PRE_PASS;
+    /// due timestamp per frame in flight attorno al render pass (0 se la coda grafica non li supporta)
+    VkQueryPool timestampQueryPool = VK_NULL_HANDLE;
+    /// nanosecondi per unita' di timestamp
+    float timestampPeriod = 0.0f;
+    /// bit validi dei timestamp della coda grafica: quelli alti vanno ignorati prima della differenza
+    uint64_t timestampMask = 0;
+    /// depthPrePass del frame in flight registrato con i timestamp, -1 se non ancora registrato
+    std::vector<int> timestampModes;
+    /// millisecondi GPU del render pass e frame misurati, senza e con depth pre-pass
+    double renderPassGpuTime[2] = {0.0, 0.0};
+    uint64_t renderPassGpuFrames[2] = {0, 0};
+    /// se falso i contenitori .dtex compressi a blocchi vengono ignorati e si usa la versione RGBA8
+    bool textureCompressionBC = false;
+    /// esiste memoria device-local e host-visible grande quanto la VRAM (GPU integrate, resizable BAR):
+    /// la geometria viene scritta direttamente li', senza passare dallo staging
+    bool unifiedMemory = false;
+    /// allineamento degli offset dinamici dei uniform buffer
+    VkDeviceSize minUniformBufferOffsetAlignment = 256;
+    /// upload raccolti tra beginUploadBatch ed endUploadBatch
+    UploadBatch uploadBatch;
+
+    /// regione occupata dello staging ring: torna libera quando e' stata rilasciata e il suo fence e' segnalato
+    struct StagingRegion {
+        VkDeviceSize begin;
+        VkDeviceSize end;
+        bool released;
+        VkFence fence;
+    };
+    /// staging ring: mappato una volta sola, le regioni vengono liberate nell'ordine in cui sono state allocate
+    VkBuffer stagingRingBuffer = VK_NULL_HANDLE;
+    MemoryAllocation stagingRingMemory;
+    char *stagingRingData = nullptr;
+    std::deque<StagingRegion> stagingRegions;
+    /// le texture riempiono lo staging dai thread di caricamento
+    std::mutex stagingRingMutex;
+    /// un command pool per frame in flight, azzerato in blocco quando il fence del frame e' segnalato,
+    /// e il command buffer del frame allocato da esso
+    std::vector<VkCommandPool> frameCommandPools;
     std::vector<VkCommandBuffer> commandBuffers;
+    CommandRecorder commandRecorder;
 
     // Lesson 14
     VkSwapchainKHR swapChain;
@@ -340,6 +1166,8 @@ protected:
 
     // Lesson 19
     VkRenderPass renderPass;
+    /// con il culling su GPU: continua il primo render pass (LOAD) per i meshlet recuperati da CULL_PHASE_LATE
+    VkRenderPass lateRenderPass = VK_NULL_HANDLE;
 
     VkDescriptorPool descriptorPool;
 
@@ -349,13 +1177,17 @@ protected:
 
     // L22.1 --- depth buffer allocation (Z-buffer)
     VkImage depthImage;
-    VkDeviceMemory depthImageMemory;
+    MemoryAllocation depthImageMemory;
     VkImageView depthImageView;
 
     // L22.2 --- Frame buffers
     std::vector<VkFramebuffer> swapChainFramebuffers;
     size_t currentFrame = 0;
     bool framebufferResized = false;
+    /// FRAME_TIME_BENCHMARK: millisecondi di updateUniformBuffer e di registrazione dei comandi
+    /// accumulati dall'ultimo report
+    float uniformUpdateTime = 0.0f;
+    float commandRecordTime = 0.0f;
 
 
     // L22.3 --- Synchronization objects
@@ -391,18 +1223,29 @@ protected:
         createSurface();                // L13
         pickPhysicalDevice();            // L14
         createLogicalDevice();            // L14
+        memoryAllocator.init(this);
+        gpuCulling.init(this);
         createSwapChain();                // L15
         createImageViews();                // L15
         createRenderPass();                // L19
         createCommandPool();            // L13
+        createStagingRing();
+        if (MIPMAP_BENCHMARK) {
+            benchmarkMipmapGeneration();
+        }
+        textureStreamer.init(this);
         createDepthResources();            // L22.1
         createFramebuffers();            // L22.2
         createDescriptorPool();            // L21
 
+        indirectDrawBuffer.init(this);
         localInit();
+        indirectDrawBuffer.create();
+        gpuCulling.create();
 
         createCommandBuffers();            // L22.5 (13)
         createSyncObjects();            // L22.3
+        createTimestampQueries();
     }
 
     // Lesson 12 and 22.0
@@ -587,7 +1430,7 @@ protected:
         vkGetPhysicalDeviceFeatures(device, &supportedFeatures);
 
         return indices.isComplete() && extensionsSupported && swapChainAdequate &&
-               supportedFeatures.samplerAnisotropy;
+               supportedFeatures.samplerAnisotropy && supportedFeatures.shaderSampledImageArrayDynamicIndexing;
     }
 
     // Lesson 13
@@ -692,8 +1535,61 @@ protected:
             queueCreateInfos.push_back(queueCreateInfo);
         }
 
+        VkPhysicalDeviceFeatures supportedFeatures;
+        vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+        multiDrawIndirect = supportedFeatures.multiDrawIndirect == VK_TRUE;
+        textureCompressionBC = supportedFeatures.textureCompressionBC == VK_TRUE;
+
+        /// estensioni opzionali abilitate solo se presenti; senza multiDrawIndirect il conteggio non serve
+        std::vector<const char *> enabledExtensions(deviceExtensions.begin(), deviceExtensions.end());
+        uint32_t extensionCount;
+        vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, nullptr);
+        std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+        vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount,
+                                             availableExtensions.data());
+        for (const auto &extension: availableExtensions) {
+            if (multiDrawIndirect &&
+                strcmp(extension.extensionName, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME) == 0) {
+                drawIndirectCount = true;
+                enabledExtensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+            }
+        }
+
+        VkPhysicalDeviceProperties deviceProperties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+        unifiedMemory = false;
+        VkPhysicalDeviceMemoryProperties memoryProperties;
+        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+        const VkMemoryPropertyFlags unifiedFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+                                                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                                   VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+        for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+            /// la finestra BAR classica da 256 MB e' troppo piccola per farci stare la geometria
+            if ((memoryProperties.memoryTypes[i].propertyFlags & unifiedFlags) == unifiedFlags &&
+                memoryProperties.memoryHeaps[memoryProperties.memoryTypes[i].heapIndex].size >
+                256 * 1024 * 1024) {
+                unifiedMemory = true;
+            }
+        }
+        minUniformBufferOffsetAlignment = deviceProperties.limits.minUniformBufferOffsetAlignment;
+        /// timestampComputeAndGraphics non basta: la famiglia grafica puo' comunque avere 0 bit validi
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+        uint32_t timestampValidBits = queueFamilies[indices.graphicsFamily.value()].timestampValidBits;
+        if (deviceProperties.limits.timestampComputeAndGraphics && timestampValidBits > 0) {
+            timestampPeriod = deviceProperties.limits.timestampPeriod;
+            /// con 64 bit lo shift sarebbe indefinito
+            timestampMask = timestampValidBits >= 64 ? ~0ull : (1ull << timestampValidBits) - 1;
+        }
+
         VkPhysicalDeviceFeatures deviceFeatures{};
         deviceFeatures.samplerAnisotropy = VK_TRUE;
+        /// gli oggetti scelgono la loro texture nell'array condiviso con un indice letto dal uniform buffer
+        deviceFeatures.shaderSampledImageArrayDynamicIndexing = VK_TRUE;
+        deviceFeatures.multiDrawIndirect = multiDrawIndirect ? VK_TRUE : VK_FALSE;
+        deviceFeatures.textureCompressionBC = textureCompressionBC ? VK_TRUE : VK_FALSE;
 
         VkDeviceCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -704,8 +1600,8 @@ protected:
 
         createInfo.pEnabledFeatures = &deviceFeatures;
         createInfo.enabledExtensionCount =
-                static_cast<uint32_t>(deviceExtensions.size());
-        createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+                static_cast<uint32_t>(enabledExtensions.size());
+        createInfo.ppEnabledExtensionNames = enabledExtensions.data();
 
         createInfo.enabledLayerCount =
                 static_cast<uint32_t>(validationLayers.size());
@@ -720,6 +1616,12 @@ protected:
 
         vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
         vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
+
+        if (drawIndirectCount) {
+            cmdDrawIndexedIndirectCount = (PFN_vkCmdDrawIndexedIndirectCountKHR)
+                    vkGetDeviceProcAddr(device, "vkCmdDrawIndexedIndirectCountKHR");
+            drawIndirectCount = cmdDrawIndexedIndirectCount != nullptr;
+        }
     }
 
     // Lesson 14
@@ -870,7 +1772,9 @@ protected:
         depthAttachment.format = VK_FORMAT_D32_SFLOAT;
         depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
         depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-        depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        /// il culling su GPU costruisce la piramide di profondita' dal depth buffer dopo il render pass
+        depthAttachment.storeOp = gpuCulling.enabled ? VK_ATTACHMENT_STORE_OP_STORE
+                                                     : VK_ATTACHMENT_STORE_OP_DONT_CARE;
         depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
         depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
         depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
@@ -890,7 +1794,9 @@ protected:
         colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
         colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
         colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+        /// con il culling su GPU l'immagine viene presentata dopo il secondo render pass
+        colorAttachment.finalLayout = gpuCulling.enabled ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
+                                                         : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
         VkAttachmentReference colorAttachmentRef{};
         colorAttachmentRef.attachment = 0;
@@ -929,6 +1835,29 @@ protected:
             PrintVkError(result);
             throw std::runtime_error("failed to create render pass!");
         }
+        if (!gpuCulling.enabled) {
+            return;
+        }
+
+        /// stessi attachment, quindi compatibile con framebuffer, pipeline e command buffer secondari del primo;
+        /// il depth buffer torna in DEPTH_STENCIL_ATTACHMENT_OPTIMAL con la barriera di recordDepthPyramid
+        colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+        colorAttachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+        depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+        depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        depthAttachment.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+        attachments = {colorAttachment, depthAttachment};
+
+        /// i disegni del primo render pass scrivono il colore prima di questo
+        dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+
+        result = vkCreateRenderPass(device, &renderPassInfo, nullptr, &lateRenderPass);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create render pass!");
+        }
     }
 
     // Lesson 22.2
@@ -983,7 +1912,8 @@ protected:
 
         createImage(swapChainExtent.width, swapChainExtent.height, 1, depthFormat,
                     VK_IMAGE_TILING_OPTIMAL,
-                    VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+                    VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+                    (gpuCulling.enabled ? VK_IMAGE_USAGE_SAMPLED_BIT : 0),
                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
                     depthImage, depthImageMemory);
         depthImageView = createImageView(depthImage, depthFormat,
@@ -991,7 +1921,7 @@ protected:
     }
 
     void createSkyBoxImage(uint32_t width, uint32_t height, uint32_t mipLevels, VkImage &image,
-                           VkDeviceMemory &imageMemory) {
+                           MemoryAllocation &imageMemory, VkFormat format = VK_FORMAT_R8G8B8A8_SRGB) {
         VkImageCreateInfo imageInfo{};
         imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
         imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -1001,7 +1931,7 @@ protected:
         imageInfo.mipLevels = mipLevels;
         /// uno per ogni faccia
         imageInfo.arrayLayers = 6;
-        imageInfo.format = VK_FORMAT_R8G8B8A8_SRGB;
+        imageInfo.format = format;
         imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
         imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
         imageInfo.usage =
@@ -1019,17 +1949,9 @@ protected:
         VkMemoryRequirements memRequirements;
         vkGetImageMemoryRequirements(device, image, &memRequirements);
 
-        VkMemoryAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocInfo.allocationSize = memRequirements.size;
-        allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits,
-                                                   VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-        if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) !=
-            VK_SUCCESS) {
-            throw std::runtime_error("failed to allocate image memory!");
-        }
+        imageMemory = memoryAllocator.allocate(memRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
 
-        vkBindImageMemory(device, image, imageMemory, 0);
+        vkBindImageMemory(device, image, imageMemory.memory, imageMemory.offset);
     }
 
 
@@ -1039,7 +1961,7 @@ protected:
                      VkFormat format,
                      VkImageTiling tiling, VkImageUsageFlags usage,
                      VkMemoryPropertyFlags properties, VkImage &image,
-                     VkDeviceMemory &imageMemory) {
+                     MemoryAllocation &imageMemory) {
         VkImageCreateInfo imageInfo{};
         imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
         imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -1066,193 +1988,326 @@ protected:
         VkMemoryRequirements memRequirements;
         vkGetImageMemoryRequirements(device, image, &memRequirements);
 
-        VkMemoryAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocInfo.allocationSize = memRequirements.size;
-        allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits,
-                                                   properties);
-        if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) !=
-            VK_SUCCESS) {
-            throw std::runtime_error("failed to allocate image memory!");
-        }
+        imageMemory = memoryAllocator.allocate(memRequirements, properties, tiling == VK_IMAGE_TILING_LINEAR);
 
-        vkBindImageMemory(device, image, imageMemory, 0);
+        vkBindImageMemory(device, image, imageMemory.memory, imageMemory.offset);
     }
 
-    // New - Lesson 23
-    void generateMipmaps(VkImage image, VkFormat imageFormat,
-                         int32_t texWidth, int32_t texHeight,
-                         uint32_t mipLevels, int layerCount) {
+    /// vero se il formato puo' essere campionato con filtro lineare da un'immagine optimal
+    bool isTextureFormatSupported(VkFormat format) {
+        if (bakedFormatBlockSize(format) != 0 && !textureCompressionBC) {
+            return false;
+        }
+        VkFormatProperties formatProperties;
+        vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &formatProperties);
+        VkFormatFeatureFlags required = VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT |
+                                        VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+        return (formatProperties.optimalTilingFeatures & required) == required;
+    }
+
+    /// vkCmdBlitImage con filtro lineare, usato per generare i mip sulla GPU
+    bool isLinearBlitSupported(VkFormat format) {
         VkFormatProperties formatProperties;
-        vkGetPhysicalDeviceFormatProperties(physicalDevice, imageFormat,
-                                            &formatProperties);
+        vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &formatProperties);
+        VkFormatFeatureFlags required = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT |
+                                        VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+        return (formatProperties.optimalTilingFeatures & required) == required;
+    }
 
-        if (!(formatProperties.optimalTilingFeatures &
-              VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT)) {
+    /// sostituisce il blit con la catena di mip calcolata su CPU (MipGenerator.hpp): il livello 0 viene copiato in
+    /// uno staging che contiene tutti i livelli e l'upload diventa una copia con una regione per livello
+    void generateMipmapsOnHost(ImageUpload &upload) {
+        if (upload.format != VK_FORMAT_R8G8B8A8_SRGB && upload.format != VK_FORMAT_R8G8B8A8_UNORM) {
             throw std::runtime_error("texture image format does not support linear blitting!");
         }
 
-        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+        std::vector<uint64_t> offsets(upload.mipLevels);
+        VkDeviceSize size = 0;
+        for (uint32_t level = 0; level < upload.mipLevels; level++) {
+            offsets[level] = size;
+            size += mipLevelSize(upload.width, upload.height, level, upload.layerCount);
+        }
+        /// la catena viene costruita in memoria di sistema: ogni livello rilegge il precedente, e lo staging
+        /// (host-coherent, spesso write-combined) e' lento da leggere. Nello staging si scrive una volta sola
+        std::vector<unsigned char> chain(static_cast<size_t>(size));
+        memcpy(chain.data(),
+               static_cast<char *>(upload.staging.data) + (upload.regions[0].bufferOffset - upload.staging.offset),
+               static_cast<size_t>(mipLevelSize(upload.width, upload.height, 0, upload.layerCount)));
+        generateMipChain(chain.data(), offsets, upload.width, upload.height, upload.mipLevels, upload.layerCount,
+                         upload.format == VK_FORMAT_R8G8B8A8_SRGB);
+        StagingAllocation staging = allocateStaging(size);
+        memcpy(staging.data, chain.data(), chain.size());
+
+        releaseStaging(upload.staging);
+        upload.staging = staging;
+        upload.regions.clear();
+        for (uint32_t level = 0; level < upload.mipLevels; level++) {
+            VkBufferImageCopy region = imageCopyRegion(staging.offset + offsets[level],
+                                                       std::max(upload.width >> level, 1u),
+                                                       std::max(upload.height >> level, 1u), upload.layerCount);
+            region.imageSubresource.mipLevel = level;
+            upload.regions.push_back(region);
+        }
+        upload.generateMipmaps = false;
+    }
 
-        VkImageMemoryBarrier barrier{};
-        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        barrier.image = image;
-        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        barrier.subresourceRange.baseArrayLayer = 0;
-        barrier.subresourceRange.layerCount = layerCount;
-        barrier.subresourceRange.levelCount = 1;
+    /// MIPMAP_BENCHMARK: stessa immagine 1024x1024 con il blit su GPU e con il generatore su CPU. I tempi comprendono
+    /// la copia nello staging, l'upload e l'attesa della fence; i MB/s sono riferiti al livello 0. Con lati potenza
+    /// di 2 i due filtri coincidono; con lati dispari il generatore su CPU media 3 texel e non e' piu' un confronto
+    /// alla pari (vedi MipGenerator.hpp)
+    void benchmarkMipmapGeneration() {
+        const uint32_t size = 1024;
+        const int iterations = 16;
+        uint32_t levels = static_cast<uint32_t>(std::floor(std::log2(size))) + 1;
+        VkDeviceSize imageSize = size * size * 4;
+        std::vector<unsigned char> pixels(static_cast<size_t>(imageSize));
+        for (size_t i = 0; i < pixels.size(); i++) {
+            pixels[i] = static_cast<unsigned char>(i * 31 + (i >> 12));
+        }
 
-        int32_t mipWidth = texWidth;
-        int32_t mipHeight = texHeight;
+        for (bool host: {false, true}) {
+            if (!host && !isLinearBlitSupported(VK_FORMAT_R8G8B8A8_SRGB)) {
+                continue;
+            }
+            double seconds = 0.0;
+            for (int i = 0; i < iterations; i++) {
+                VkImage image;
+                MemoryAllocation imageMemory;
+                createImage(size, size, levels, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL,
+                            VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                            VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, imageMemory);
+
+                auto start = std::chrono::high_resolution_clock::now();
+                StagingAllocation staging = allocateStaging(imageSize);
+                memcpy(staging.data, pixels.data(), pixels.size());
+                ImageUpload upload{image, VK_FORMAT_R8G8B8A8_SRGB, size, size, levels, 1, staging,
+                                   {imageCopyRegion(staging.offset, size, size, 1)}, true};
+                if (host) {
+                    generateMipmapsOnHost(upload);
+                }
+                uploadImage(std::move(upload));
+                seconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
 
-        for (uint32_t i = 1; i < mipLevels; i++) {
-            barrier.subresourceRange.baseMipLevel = i - 1;
-            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-            barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-            barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+                vkDestroyImage(device, image, nullptr);
+                memoryAllocator.free(imageMemory);
+            }
+            std::cout << (host ? "CPU" : "GPU blit") << " mipmaps: "
+                      << imageSize * iterations / seconds / (1024.0 * 1024.0) << " MB/s\n";
+        }
+    }
 
-            vkCmdPipelineBarrier(commandBuffer,
-                                 VK_PIPELINE_STAGE_TRANSFER_BIT,
-                                 VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
-                                 0, nullptr, 0, nullptr,
-                                 1, &barrier);
+    // New - Lesson 23
+    VkCommandBuffer beginSingleTimeCommands() {
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandPool = commandPool;
+        allocInfo.commandBufferCount = 1;
 
-            VkImageBlit blit{};
-            blit.srcOffsets[0] = {0, 0, 0};
-            blit.srcOffsets[1] = {mipWidth, mipHeight, 1};
-            blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-            blit.srcSubresource.mipLevel = i - 1;
-            blit.srcSubresource.baseArrayLayer = 0;
-            blit.srcSubresource.layerCount = 1;
-            blit.dstOffsets[0] = {0, 0, 0};
-            blit.dstOffsets[1] = {mipWidth > 1 ? mipWidth / 2 : 1,
-                                  mipHeight > 1 ? mipHeight / 2 : 1, 1};
-            blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-            blit.dstSubresource.mipLevel = i;
-            blit.dstSubresource.baseArrayLayer = 0;
-            blit.dstSubresource.layerCount = 1;
-
-            vkCmdBlitImage(commandBuffer, image,
-                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                           image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
-                           &blit, VK_FILTER_LINEAR);
-
-            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-            barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-            barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        VkCommandBuffer commandBuffer;
+        vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
 
-            vkCmdPipelineBarrier(commandBuffer,
-                                 VK_PIPELINE_STAGE_TRANSFER_BIT,
-                                 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
-                                 0, nullptr, 0, nullptr,
-                                 1, &barrier);
-            if (mipWidth > 1) mipWidth /= 2;
-            if (mipHeight > 1) mipHeight /= 2;
-        }
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-        barrier.subresourceRange.baseMipLevel = mipLevels - 1;
-        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-        vkCmdPipelineBarrier(commandBuffer,
-                             VK_PIPELINE_STAGE_TRANSFER_BIT,
-                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
-                             0, nullptr, 0, nullptr,
-                             1, &barrier);
+        vkBeginCommandBuffer(commandBuffer, &beginInfo);
 
-        endSingleTimeCommands(commandBuffer);
+        return commandBuffer;
     }
 
     // New - Lesson 23
-    void transitionImageLayout(VkImage image, VkFormat format,
-                               VkImageLayout oldLayout, VkImageLayout newLayout,
-                               uint32_t mipLevels, int layerCount) {
-        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+    void endSingleTimeCommands(VkCommandBuffer commandBuffer) {
+        vkEndCommandBuffer(commandBuffer);
 
-        VkImageMemoryBarrier barrier{};
-        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        barrier.oldLayout = oldLayout;
-        barrier.newLayout = newLayout;
-        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.image = image;
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &commandBuffer;
+        vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
+        vkQueueWaitIdle(graphicsQueue);
 
-        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        barrier.subresourceRange.baseMipLevel = 0;
-        barrier.subresourceRange.levelCount = mipLevels;
-        barrier.subresourceRange.baseArrayLayer = 0;
-        barrier.subresourceRange.layerCount = layerCount;
+        vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+    }
 
-        barrier.srcAccessMask = 0;
-        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    /// tra beginUploadBatch ed endUploadBatch gli upload delle immagini vengono solo raccolti; endUploadBatch li
+    /// registra e li invia con una sola submit senza attendere la GPU, vedi uploadsComplete()
+    void beginUploadBatch() {
+        uploadBatch.begin(this);
+    }
 
-        vkCmdPipelineBarrier(commandBuffer,
-                             VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                             VK_ACCESS_TRANSFER_WRITE_BIT, 0,
-                             0, nullptr, 0, nullptr, 1, &barrier);
+    void endUploadBatch() {
+        uploadBatch.submit();
+    }
 
-        endSingleTimeCommands(commandBuffer);
+    /// vero quando l'ultimo batch e' stato eseguito dalla GPU; libera il suo staging
+    bool uploadsComplete() {
+        return uploadBatch.isComplete();
     }
 
-    // New - Lesson 23
-    void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t
-    width, uint32_t height, int layerCount) {
-        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+    /// fuori da un batch l'upload viene inviato subito e atteso, come un comando "single time"
+    void uploadImage(ImageUpload upload) {
+        if (uploadBatch.recording) {
+            uploadBatch.uploadImage(std::move(upload));
+            return;
+        }
+        UploadBatch immediate;
+        immediate.begin(this);
+        immediate.uploadImage(std::move(upload));
+        immediate.submit();
+        immediate.wait();
+    }
 
-        VkBufferImageCopy region{};
-        region.bufferOffset = 0;
-        region.bufferRowLength = 0;
-        region.bufferImageHeight = 0;
-        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        region.imageSubresource.mipLevel = 0;
-        region.imageSubresource.baseArrayLayer = 0;
-        region.imageSubresource.layerCount = layerCount;
-        region.imageOffset = {0, 0, 0};
-        region.imageExtent = {width, height, 1};
+    void uploadBuffer(BufferUpload upload) {
+        if (uploadBatch.recording) {
+            uploadBatch.uploadBuffer(upload);
+            return;
+        }
+        UploadBatch immediate;
+        immediate.begin(this);
+        immediate.uploadBuffer(upload);
+        immediate.submit();
+        immediate.wait();
+    }
 
-        vkCmdCopyBufferToImage(commandBuffer, buffer, image,
-                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+    /// buffer letto solo dalla GPU (le mesh non vengono mai riscritte): in memoria device-local, riempito con una
+    /// copia dallo staging. Con memoria unificata viene scritto direttamente nella memoria device-local e
+    /// host-visible; senza DEVICE_LOCAL_GEOMETRY resta in memoria host-visible
+    void createGeometryBuffer(const void *src, VkDeviceSize size, VkBufferUsageFlags usage,
+                              VkBuffer &buffer, MemoryAllocation &bufferMemory) {
+        if (unifiedMemory || !DEVICE_LOCAL_GEOMETRY) {
+            VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                               VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+            if (unifiedMemory && DEVICE_LOCAL_GEOMETRY) {
+                properties |= VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+            }
+            createBuffer(size, usage, properties, buffer, bufferMemory);
+            void *data = memoryAllocator.map(bufferMemory);
+            memcpy(data, src, static_cast<size_t>(size));
+            memoryAllocator.unmap(bufferMemory);
+            return;
+        }
 
-        endSingleTimeCommands(commandBuffer);
+        createBuffer(size, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     buffer, bufferMemory);
+        StagingAllocation staging = allocateStaging(size);
+        memcpy(staging.data, src, static_cast<size_t>(size));
+        uploadBuffer({buffer, staging, size});
     }
 
-    // New - Lesson 23
-    VkCommandBuffer beginSingleTimeCommands() {
-        VkCommandBufferAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        allocInfo.commandPool = commandPool;
-        allocInfo.commandBufferCount = 1;
+    void destroyStagingBuffer(VkBuffer buffer, MemoryAllocation &bufferMemory) {
+        vkDestroyBuffer(device, buffer, nullptr);
+        memoryAllocator.free(bufferMemory);
+    }
 
-        VkCommandBuffer commandBuffer;
-        vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
+    void createStagingRing() {
+        createBuffer(STAGING_RING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     stagingRingBuffer, stagingRingMemory);
+        stagingRingData = static_cast<char *>(memoryAllocator.map(stagingRingMemory));
+    }
 
-        VkCommandBufferBeginInfo beginInfo{};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    void destroyStagingRing() {
+        memoryAllocator.unmap(stagingRingMemory);
+        vkDestroyBuffer(device, stagingRingBuffer, nullptr);
+        memoryAllocator.free(stagingRingMemory);
+        stagingRingBuffer = VK_NULL_HANDLE;
+        stagingRingData = nullptr;
+        stagingRegions.clear();
+    }
 
-        vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    /// libera le regioni in testa gia' rilasciate dal cui upload la GPU ha finito di leggere
+    void reclaimStagingRegions() {
+        while (!stagingRegions.empty() && stagingRegions.front().released &&
+               (stagingRegions.front().fence == VK_NULL_HANDLE ||
+                vkGetFenceStatus(device, stagingRegions.front().fence) == VK_SUCCESS)) {
+            stagingRegions.pop_front();
+        }
+    }
 
-        return commandBuffer;
+    /// cerca spazio dopo l'ultima regione allocata o, se non basta, all'inizio del ring; -1 se non c'e'
+    VkDeviceSize findStagingSpace(VkDeviceSize size, VkDeviceSize alignment) {
+        if (stagingRegions.empty()) {
+            return size <= STAGING_RING_SIZE ? 0 : static_cast<VkDeviceSize>(-1);
+        }
+        VkDeviceSize tail = stagingRegions.front().begin;
+        VkDeviceSize head = (stagingRegions.back().end + alignment - 1) & ~(alignment - 1);
+        bool wrapped = stagingRegions.back().begin < tail;
+        if (wrapped) {
+            return head + size <= tail ? head : static_cast<VkDeviceSize>(-1);
+        }
+        if (head + size <= STAGING_RING_SIZE) {
+            return head;
+        }
+        return size <= tail ? 0 : static_cast<VkDeviceSize>(-1);
     }
 
-    // New - Lesson 23
-    void endSingleTimeCommands(VkCommandBuffer commandBuffer) {
-        vkEndCommandBuffer(commandBuffer);
+    /// sotto-alloca dallo staging ring; se il ring e' pieno di regioni ancora in uso (o la richiesta e' piu'
+    /// grande del ring) si ripiega su un buffer dedicato, come prima
+    StagingAllocation allocateStaging(VkDeviceSize size, VkDeviceSize alignment = 16) {
+        StagingAllocation allocation;
+        allocation.size = size;
+        {
+            std::lock_guard<std::mutex> lock(stagingRingMutex);
+            reclaimStagingRegions();
+            VkDeviceSize offset = findStagingSpace(size, alignment);
+            /// se la prima regione aspetta solo il suo fence vale la pena attenderlo invece di allocare
+            while (offset == static_cast<VkDeviceSize>(-1) && !stagingRegions.empty() &&
+                   stagingRegions.front().released && stagingRegions.front().fence != VK_NULL_HANDLE) {
+                vkWaitForFences(device, 1, &stagingRegions.front().fence, VK_TRUE, UINT64_MAX);
+                reclaimStagingRegions();
+                offset = findStagingSpace(size, alignment);
+            }
+            if (offset != static_cast<VkDeviceSize>(-1)) {
+                stagingRegions.push_back({offset, offset + size, false, VK_NULL_HANDLE});
+                allocation.buffer = stagingRingBuffer;
+                allocation.offset = offset;
+                allocation.data = stagingRingData + offset;
+                return allocation;
+            }
+        }
 
-        VkSubmitInfo submitInfo{};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffer;
-        vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-        vkQueueWaitIdle(graphicsQueue);
+        createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     allocation.buffer, allocation.memory);
+        allocation.data = memoryAllocator.map(allocation.memory);
+        return allocation;
+    }
 
-        vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+    /// la regione del ring resta occupata finche' fence (se presente) non e' segnalato; un buffer dedicato
+    /// viene distrutto subito, quindi va rilasciato solo quando la GPU non lo usa piu'
+    void releaseStaging(StagingAllocation &allocation, VkFence fence = VK_NULL_HANDLE) {
+        if (allocation.buffer == VK_NULL_HANDLE) {
+            return;
+        }
+        if (allocation.memory.block != nullptr) {
+            memoryAllocator.unmap(allocation.memory);
+            destroyStagingBuffer(allocation.buffer, allocation.memory);
+        } else {
+            std::lock_guard<std::mutex> lock(stagingRingMutex);
+            for (auto &region: stagingRegions) {
+                if (region.begin == allocation.offset && !region.released) {
+                    region.released = true;
+                    region.fence = fence;
+                    break;
+                }
+            }
+            reclaimStagingRegions();
+        }
+        allocation = StagingAllocation();
+    }
+
+    /// da chiamare prima di distruggere un fence usato in releaseStaging, quando e' gia' segnalato
+    void retireStagingFence(VkFence fence) {
+        std::lock_guard<std::mutex> lock(stagingRingMutex);
+        for (auto &region: stagingRegions) {
+            if (region.fence == fence) {
+                region.fence = VK_NULL_HANDLE;
+            }
+        }
+        reclaimStagingRegions();
     }
 
 
@@ -1262,7 +2317,7 @@ protected:
     // Lesson 21
     void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
                       VkMemoryPropertyFlags properties,
-                      VkBuffer &buffer, VkDeviceMemory &bufferMemory) {
+                      VkBuffer &buffer, MemoryAllocation &bufferMemory) {
         VkBufferCreateInfo bufferInfo{};
         bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
         bufferInfo.size = size;
@@ -1279,20 +2334,9 @@ protected:
         VkMemoryRequirements memRequirements;
         vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 
-        VkMemoryAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocInfo.allocationSize = memRequirements.size;
-        allocInfo.memoryTypeIndex =
-                findMemoryType(memRequirements.memoryTypeBits, properties);
-
-        result = vkAllocateMemory(device, &allocInfo, nullptr,
-                                  &bufferMemory);
-        if (result != VK_SUCCESS) {
-            PrintVkError(result);
-            throw std::runtime_error("failed to allocate vertex buffer memory!");
-        }
+        bufferMemory = memoryAllocator.allocate(memRequirements, properties, true);
 
-        vkBindBufferMemory(device, buffer, bufferMemory, 0);
+        vkBindBufferMemory(device, buffer, bufferMemory.memory, bufferMemory.offset);
     }
 
     // Lesson 21
@@ -1314,7 +2358,7 @@ protected:
 
     // Lesson 21
     void createDescriptorPool() {
-        std::array<VkDescriptorPoolSize, 2> poolSizes{};
+        std::vector<VkDescriptorPoolSize> poolSizes(2);
         poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
         poolSizes[0].descriptorCount = static_cast<uint32_t>(uniformBlocksInPool *
                                                              swapChainImages.size());
@@ -1323,6 +2367,13 @@ protected:
         poolSizes[1].descriptorCount = static_cast<uint32_t>(texturesInPool *
                                                              swapChainImages.size());
         //
+        if (dynamicUniformBlocksInPool > 0) {
+            VkDescriptorPoolSize dynamicSize{};
+            dynamicSize.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+            dynamicSize.descriptorCount = static_cast<uint32_t>(dynamicUniformBlocksInPool *
+                                                                swapChainImages.size());
+            poolSizes.push_back(dynamicSize);
+        }
 
         VkDescriptorPoolCreateInfo poolInfo{};
         poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -1340,64 +2391,136 @@ protected:
 
     virtual void populateCommandBuffer(VkCommandBuffer commandBuffer, int i) = 0;
 
+    /// registrazione su piu' thread: la parte `part` di `parts` della scena in un command buffer secondario.
+    /// Viene chiamata in parallelo e non deve modificare lo stato condiviso; ogni parte lega da se' pipeline
+    /// e descriptor set. Senza override tutta la scena finisce nella parte 0 del primo render pass.
+    /// Con CULL_PHASE_LATE registra, in una sola parte, il render pass dei meshlet recuperati dal culling su GPU
+    virtual void populateCommandBufferPart(VkCommandBuffer commandBuffer, int i, uint32_t part, uint32_t /*parts*/,
+                                           CullPhase phase) {
+        if (part == 0 && phase == CULL_PHASE_EARLY) {
+            populateCommandBuffer(commandBuffer, i);
+        }
+    }
+
+    /// disegni del frame divisibili tra le parti; 0 (senza override) registra tutto nel primary
+    virtual uint32_t frameDrawCount() {
+        return 0;
+    }
+
     // Lesson 22.5 (and 13)
+    /// i command buffer non dipendono dalla swap chain: vengono creati una volta, uno per frame in flight
     void createCommandBuffers() {
-        // Lesson 13
-        commandBuffers.resize(swapChainFramebuffers.size());
+        QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
 
-        VkCommandBufferAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        allocInfo.commandPool = commandPool;
-        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        allocInfo.commandBufferCount = (uint32_t) commandBuffers.size();
+        VkCommandPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
 
-        VkResult result = vkAllocateCommandBuffers(device, &allocInfo,
-                                                   commandBuffers.data());
-        if (result != VK_SUCCESS) {
-            PrintVkError(result);
-            throw std::runtime_error("failed to allocate command buffers!");
-        }
+        frameCommandPools.resize(MAX_FRAMES_IN_FLIGHT);
+        commandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+            VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr, &frameCommandPools[i]);
+            if (result != VK_SUCCESS) {
+                PrintVkError(result);
+                throw std::runtime_error("failed to create command pool!");
+            }
 
-        // Lesson 22.5 --- Draw calls
-        // This is where the commands that actually draw something on screen are!
-        for (size_t i = 0; i < commandBuffers.size(); i++) {
-            VkCommandBufferBeginInfo beginInfo{};
-            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-            beginInfo.flags = 0; // Optional
-            beginInfo.pInheritanceInfo = nullptr; // Optional
+            // Lesson 13
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = frameCommandPools[i];
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            allocInfo.commandBufferCount = 1;
 
-            if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) !=
-                VK_SUCCESS) {
-                throw std::runtime_error("failed to begin recording command buffer!");
+            result = vkAllocateCommandBuffers(device, &allocInfo, &commandBuffers[i]);
+            if (result != VK_SUCCESS) {
+                PrintVkError(result);
+                throw std::runtime_error("failed to allocate command buffers!");
             }
+        }
+
+        commandRecorder.init(this, COMMAND_RECORDING_THREADS);
+    }
+
+    // Lesson 22.5 --- Draw calls
+    // This is where the commands that actually draw something on screen are!
+    /// registrato ad ogni frame in drawFrame dallo stato corrente della scena, nel command buffer del frame
+    /// in flight e con framebuffer e descriptor set dell'immagine acquisita
+    void recordCommandBuffer(uint32_t imageIndex) {
+        /// il fence di currentFrame e' gia' segnalato: nessun comando del pool e' ancora in esecuzione
+        vkResetCommandPool(device, frameCommandPools[currentFrame], 0);
+        VkCommandBuffer commandBuffer = commandBuffers[currentFrame];
 
-            VkRenderPassBeginInfo renderPassInfo{};
-            renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-            renderPassInfo.renderPass = renderPass;
-            renderPassInfo.framebuffer = swapChainFramebuffers[i];
-            renderPassInfo.renderArea.offset = {0, 0};
-            renderPassInfo.renderArea.extent = swapChainExtent;
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        beginInfo.pInheritanceInfo = nullptr; // Optional
+
+        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) !=
+            VK_SUCCESS) {
+            throw std::runtime_error("failed to begin recording command buffer!");
+        }
+
+        VkRenderPassBeginInfo renderPassInfo{};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        renderPassInfo.renderPass = renderPass;
+        renderPassInfo.framebuffer = swapChainFramebuffers[imageIndex];
+        renderPassInfo.renderArea.offset = {0, 0};
+        renderPassInfo.renderArea.extent = swapChainExtent;
+
+        std::array<VkClearValue, 2> clearValues{};
+        clearValues[0].color = initialBackgroundColor;
+        clearValues[1].depthStencil = {1.0f, 0};
 
-            std::array<VkClearValue, 2> clearValues{};
-            clearValues[0].color = initialBackgroundColor;
-            clearValues[1].depthStencil = {1.0f, 0};
+        renderPassInfo.clearValueCount =
+                static_cast<uint32_t>(clearValues.size());
+        renderPassInfo.pClearValues = clearValues.data();
 
-            renderPassInfo.clearValueCount =
-                    static_cast<uint32_t>(clearValues.size());
-            renderPassInfo.pClearValues = clearValues.data();
+        gpuCulling.recordCull(commandBuffer, imageIndex, CULL_PHASE_EARLY);
 
-            vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo,
+        if (timestampQueryPool != VK_NULL_HANDLE) {
+            vkCmdResetQueryPool(commandBuffer, timestampQueryPool, currentFrame * 2, 2);
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampQueryPool,
+                                currentFrame * 2);
+        }
+
+        uint32_t recordingParts = commandRecorder.partCount(frameDrawCount());
+        if (recordingParts > 1) {
+            vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+                                 VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+            commandRecorder.record(commandBuffer, currentFrame, imageIndex, recordingParts);
+        } else {
+            vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
                                  VK_SUBPASS_CONTENTS_INLINE);
+            populateCommandBuffer(commandBuffer, imageIndex);
+        }
 
 
-            populateCommandBuffer(commandBuffers[i], i);
+        vkCmdEndRenderPass(commandBuffer);
 
+        /// i meshlet occlusi per la piramide del frame precedente vengono riprovati contro la profondita' appena
+        /// disegnata e quelli visibili completano l'immagine
+        if (gpuCulling.enabled) {
+            gpuCulling.recordDepthPyramid(commandBuffer);
+            gpuCulling.recordCull(commandBuffer, imageIndex, CULL_PHASE_LATE);
 
-            vkCmdEndRenderPass(commandBuffers[i]);
+            renderPassInfo.renderPass = lateRenderPass;
+            renderPassInfo.clearValueCount = 0;
+            renderPassInfo.pClearValues = nullptr;
+            vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+            populateCommandBufferPart(commandBuffer, imageIndex, 0, 1, CULL_PHASE_LATE);
+            vkCmdEndRenderPass(commandBuffer);
+        }
 
-            if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
-                throw std::runtime_error("failed to record command buffer!");
-            }
+        if (timestampQueryPool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPool,
+                                currentFrame * 2 + 1);
+            timestampModes[currentFrame] = depthPrePass ? 1 : 0;
+        }
+
+        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to record command buffer!");
         }
     }
 
@@ -1433,11 +2556,87 @@ protected:
         }
     }
 
+    void createTimestampQueries() {
+        timestampModes.assign(MAX_FRAMES_IN_FLIGHT, -1);
+        if (timestampPeriod <= 0.0f) {
+            return;
+        }
+
+        VkQueryPoolCreateInfo queryPoolInfo{};
+        queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolInfo.queryCount = 2 * MAX_FRAMES_IN_FLIGHT;
+
+        VkResult result = vkCreateQueryPool(device, &queryPoolInfo, nullptr, &timestampQueryPool);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create timestamp query pool!");
+        }
+    }
+
+    /// chiamata quando il fence di currentFrame e' segnalato: i timestamp del frame sono disponibili
+    void readTimestamps() {
+        int mode = timestampModes[currentFrame];
+        if (timestampQueryPool == VK_NULL_HANDLE || mode < 0) {
+            return;
+        }
+        uint64_t timestamps[2];
+        VkResult result = vkGetQueryPoolResults(device, timestampQueryPool, currentFrame * 2, 2,
+                                                sizeof(timestamps), timestamps, sizeof(uint64_t),
+                                                VK_QUERY_RESULT_64_BIT);
+        timestamps[0] &= timestampMask;
+        timestamps[1] &= timestampMask;
+        if (result == VK_SUCCESS && timestamps[1] >= timestamps[0]) {
+            renderPassGpuTime[mode] += (timestamps[1] - timestamps[0]) * timestampPeriod / 1e6;
+            renderPassGpuFrames[mode]++;
+        }
+        timestampModes[currentFrame] = -1;
+    }
+
     // Lesson 22.6 --- Main Rendering Loop
     void mainLoop() {
+        auto reportStart = std::chrono::high_resolution_clock::now();
+        int reportFrames = 0;
         while (!glfwWindowShouldClose(window)) {
             glfwPollEvents();
             drawFrame();
+
+            if (FRAME_TIME_BENCHMARK) {
+                reportFrames++;
+                auto now = std::chrono::high_resolution_clock::now();
+                float elapsed = std::chrono::duration<float, std::chrono::milliseconds::period>(
+                        now - reportStart).count();
+                if (elapsed >= 2000.0f) {
+                    std::cout << "Frame time: " << elapsed / reportFrames << " ms, uniform update: "
+                              << uniformUpdateTime / reportFrames << " ms, command recording: "
+                              << commandRecordTime / reportFrames << " ms\n";
+                    if (gpuCulling.statsFrames > 0) {
+                        std::cout << "GPU culling: " << gpuCulling.objectsCulled / gpuCulling.statsFrames
+                                  << " objects culled, " << gpuCulling.meshletsOccluded / gpuCulling.statsFrames
+                                  << " meshlets occluded, " << gpuCulling.meshletsDrawn / gpuCulling.statsFrames
+                                  << " meshlets drawn (" << gpuCulling.meshletsLate / gpuCulling.statsFrames
+                                  << " in the late pass) per frame\n";
+                        gpuCulling.statsFrames = 0;
+                        gpuCulling.objectsCulled = 0;
+                        gpuCulling.meshletsOccluded = 0;
+                        gpuCulling.meshletsDrawn = 0;
+                        gpuCulling.meshletsLate = 0;
+                    }
+                    /// medie dall'avvio, per confrontare le due modalita' alternandole con il tasto P
+                    for (int mode = 0; mode < 2; mode++) {
+                        if (renderPassGpuFrames[mode] > 0) {
+                            std::cout << "Render pass GPU time " << (mode ? "with" : "without")
+                                      << " depth pre-pass: "
+                                      << renderPassGpuTime[mode] / renderPassGpuFrames[mode] << " ms ("
+                                      << renderPassGpuFrames[mode] << " frames)\n";
+                        }
+                    }
+                    reportStart = now;
+                    reportFrames = 0;
+                    uniformUpdateTime = 0.0f;
+                    commandRecordTime = 0.0f;
+                }
+            }
         }
 
         vkDeviceWaitIdle(device);
@@ -1454,8 +2653,10 @@ protected:
 
         vkDeviceWaitIdle(device);
 
+        gpuCulling.destroy();
         cleanupSwapChain();
         localCleanup(false);
+        indirectDrawBuffer.cleanup();
 
         createSwapChain();
         createImageViews();
@@ -1465,7 +2666,8 @@ protected:
         createFramebuffers();
         createDescriptorPool();
         localInit(false);
-        createCommandBuffers();
+        indirectDrawBuffer.create();
+        gpuCulling.create();
     }
 
     void cleanupSwapChain() {
@@ -1475,15 +2677,12 @@ protected:
 
         vkDestroyImageView(device, depthImageView, nullptr);
         vkDestroyImage(device, depthImage, nullptr);
-        vkFreeMemory(device, depthImageMemory, nullptr);
+        memoryAllocator.free(depthImageMemory);
 
         for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
             vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
         }
 
-        vkFreeCommandBuffers(device, commandPool,
-                             static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
-
         /*vkDestroyPipeline(device, PhongPipeline, nullptr);
         vkDestroyPipeline(device, PhongWirePipeline, nullptr);
         vkDestroyPipelineLayout(device, PhongPipelineLayout, nullptr);
@@ -1496,6 +2695,7 @@ protected:
         vkDestroyPipelineLayout(device, TextPipelineLayout, nullptr);*/
 
         vkDestroyRenderPass(device, renderPass, nullptr);
+        vkDestroyRenderPass(device, lateRenderPass, nullptr);
 
         for (size_t i = 0; i < swapChainImageViews.size(); i++) {
             vkDestroyImageView(device, swapChainImageViews[i], nullptr);
@@ -1528,6 +2728,9 @@ protected:
     void drawFrame() {
         vkWaitForFences(device, 1, &inFlightFences[currentFrame],
                         VK_TRUE, UINT64_MAX);
+        readTimestamps();
+        uploadsComplete();
+        textureStreamer.update();
 
         uint32_t imageIndex;
 
@@ -1547,7 +2750,15 @@ protected:
         }
         imagesInFlight[imageIndex] = inFlightFences[currentFrame];
 
+        auto updateStart = std::chrono::high_resolution_clock::now();
         updateUniformBuffer(imageIndex);
+        uniformUpdateTime += std::chrono::duration<float, std::chrono::milliseconds::period>(
+                std::chrono::high_resolution_clock::now() - updateStart).count();
+
+        auto recordStart = std::chrono::high_resolution_clock::now();
+        recordCommandBuffer(imageIndex);
+        commandRecordTime += std::chrono::duration<float, std::chrono::milliseconds::period>(
+                std::chrono::high_resolution_clock::now() - recordStart).count();
 
         VkSubmitInfo submitInfo{};
         submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
@@ -1558,7 +2769,7 @@ protected:
         submitInfo.pWaitSemaphores = waitSemaphores;
         submitInfo.pWaitDstStageMask = waitStages;
         submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
+        submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
         VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
         submitInfo.signalSemaphoreCount = 1;
         submitInfo.pSignalSemaphores = signalSemaphores;
@@ -1601,19 +2812,24 @@ protected:
     // All lessons
 
     void cleanup() {
+        gpuCulling.cleanup();
 
         vkDestroyImageView(device, depthImageView, nullptr);
         vkDestroyImage(device, depthImage, nullptr);
-        vkFreeMemory(device, depthImageMemory, nullptr);
+        memoryAllocator.free(depthImageMemory);
 
         for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
             vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
         }
 
-        vkFreeCommandBuffers(device, commandPool,
-                             static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+        /// distruggere i pool libera anche i command buffer dei frame
+        commandRecorder.cleanup();
+        for (auto frameCommandPool: frameCommandPools) {
+            vkDestroyCommandPool(device, frameCommandPool, nullptr);
+        }
 
         vkDestroyRenderPass(device, renderPass, nullptr);
+        vkDestroyRenderPass(device, lateRenderPass, nullptr);
 
         for (size_t i = 0; i < swapChainImageViews.size(); i++) {
             vkDestroyImageView(device, swapChainImageViews[i], nullptr);
@@ -1624,7 +2840,12 @@ protected:
         vkDestroyDescriptorPool(device, descriptorPool, nullptr);
 
 
+        uploadBatch.wait();
+        textureStreamer.cleanup();
         localCleanup();
+        indirectDrawBuffer.cleanup();
+
+        destroyStagingRing();
 
         for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
             vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
@@ -1632,8 +2853,14 @@ protected:
             vkDestroyFence(device, inFlightFences[i], nullptr);
         }
 
+        if (timestampQueryPool != VK_NULL_HANDLE) {
+            vkDestroyQueryPool(device, timestampQueryPool, nullptr);
+        }
+
         vkDestroyCommandPool(device, commandPool, nullptr);
 
+        memoryAllocator.cleanup();
+
         vkDestroyDevice(device, nullptr);
 
         DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
@@ -1648,166 +2875,1537 @@ protected:
 
 };
 
+void DeviceMemoryAllocator::init(BaseProject *bp) {
+    BP = bp;
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(BP->physicalDevice, &properties);
+    bufferImageGranularity = properties.limits.bufferImageGranularity;
+}
 
-void Model::loadModel(std::string file) {
-    tinyobj::attrib_t attrib;
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
-    std::string warn, err;
-
-    if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err,
-                          file.c_str())) {
-        throw std::runtime_error(warn + err);
+/// first fit sugli intervalli liberi dei blocchi compatibili; se nessuno ha spazio si alloca un nuovo blocco
+MemoryAllocation DeviceMemoryAllocator::allocate(const VkMemoryRequirements &requirements,
+                                                 VkMemoryPropertyFlags properties, bool linear) {
+    uint32_t memoryType = BP->findMemoryType(requirements.memoryTypeBits, properties);
+    /// senza vincoli di granularita' buffer e immagini possono condividere i blocchi
+    if (bufferImageGranularity <= 1) {
+        linear = true;
     }
+    bool dedicated = requirements.size > DEVICE_MEMORY_BLOCK_SIZE / 2;
 
-    for (const auto &shape: shapes) {
-        for (const auto &index: shape.mesh.indices) {
-            Vertex vertex{};
-
-            vertex.pos = {
-                    attrib.vertices[3 * index.vertex_index + 0],
-                    attrib.vertices[3 * index.vertex_index + 1],
-                    attrib.vertices[3 * index.vertex_index + 2]
-            };
-
-            vertex.texCoord = {
-                    attrib.texcoords[2 * index.texcoord_index + 0],
-                    1 - attrib.texcoords[2 * index.texcoord_index + 1]
-            };
-
-            vertex.norm = {
-                    attrib.normals[3 * index.normal_index + 0],
-                    attrib.normals[3 * index.normal_index + 1],
-                    attrib.normals[3 * index.normal_index + 2]
-            };
-
-            vertices.push_back(vertex);
-            indices.push_back(vertices.size() - 1);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!dedicated) {
+        for (auto &block: blocks) {
+            if (block->dedicated || block->memoryType != memoryType || block->linear != linear) {
+                continue;
+            }
+            for (auto range = block->freeRanges.begin(); range != block->freeRanges.end(); range++) {
+                VkDeviceSize begin = range->first;
+                VkDeviceSize end = range->first + range->second;
+                VkDeviceSize offset = (begin + requirements.alignment - 1) / requirements.alignment *
+                                      requirements.alignment;
+                if (offset + requirements.size > end) {
+                    continue;
+                }
+                /// il padding dell'allineamento resta libero e si fonde con la risorsa quando viene liberata
+                block->freeRanges.erase(range);
+                if (offset > begin) {
+                    block->freeRanges[begin] = offset - begin;
+                }
+                if (offset + requirements.size < end) {
+                    block->freeRanges[offset + requirements.size] = end - offset - requirements.size;
+                }
+                block->allocationCount++;
+                return {block.get(), block->memory, offset, requirements.size};
+            }
         }
     }
 
+    auto block = std::make_unique<MemoryBlock>();
+    block->size = dedicated ? requirements.size : DEVICE_MEMORY_BLOCK_SIZE;
+    block->memoryType = memoryType;
+    block->linear = linear;
+    block->dedicated = dedicated;
+
+    VkMemoryAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = block->size;
+    allocInfo.memoryTypeIndex = memoryType;
+    VkResult result = vkAllocateMemory(BP->device, &allocInfo, nullptr, &block->memory);
+    if (result != VK_SUCCESS) {
+        PrintVkError(result);
+        throw std::runtime_error("failed to allocate device memory!");
+    }
 
+    if (block->size > requirements.size) {
+        block->freeRanges[requirements.size] = block->size - requirements.size;
+    }
+    block->allocationCount = 1;
+    blocks.push_back(std::move(block));
+    return {blocks.back().get(), blocks.back()->memory, 0, requirements.size};
 }
 
-// Lesson 21
-void Model::createVertexBuffer() {
-    VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
-
-    BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                     vertexBuffer, vertexBufferMemory);
-
-    void *data;
-    vkMapMemory(BP->device, vertexBufferMemory, 0, bufferSize, 0, &data);
-    memcpy(data, vertices.data(), (size_t) bufferSize);
-    vkUnmapMemory(BP->device, vertexBufferMemory);
+void DeviceMemoryAllocator::free(MemoryAllocation &allocation) {
+    if (allocation.block == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    MemoryBlock *block = allocation.block;
+    if (block->dedicated) {
+        if (block->mapped != nullptr) {
+            vkUnmapMemory(BP->device, block->memory);
+        }
+        vkFreeMemory(BP->device, block->memory, nullptr);
+        blocks.erase(std::find_if(blocks.begin(), blocks.end(),
+                                  [block](const std::unique_ptr<MemoryBlock> &b) { return b.get() == block; }));
+    } else {
+        /// l'intervallo torna libero e viene unito a quelli adiacenti
+        auto range = block->freeRanges.emplace(allocation.offset, allocation.size).first;
+        auto next = std::next(range);
+        if (next != block->freeRanges.end() && range->first + range->second == next->first) {
+            range->second += next->second;
+            block->freeRanges.erase(next);
+        }
+        if (range != block->freeRanges.begin()) {
+            auto previous = std::prev(range);
+            if (previous->first + previous->second == range->first) {
+                previous->second += range->second;
+                block->freeRanges.erase(range);
+            }
+        }
+        block->allocationCount--;
+    }
+    allocation = MemoryAllocation();
 }
 
-void Model::createIndexBuffer() {
-    VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
-
-    BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                     indexBuffer, indexBufferMemory);
-
-    void *data;
-    vkMapMemory(BP->device, indexBufferMemory, 0, bufferSize, 0, &data);
-    memcpy(data, indices.data(), (size_t) bufferSize);
-    vkUnmapMemory(BP->device, indexBufferMemory);
+/// mappa l'intero blocco alla prima richiesta e ritorna il puntatore alla risorsa; ogni map va chiusa con unmap
+void *DeviceMemoryAllocator::map(const MemoryAllocation &allocation) {
+    std::lock_guard<std::mutex> lock(mutex);
+    MemoryBlock *block = allocation.block;
+    if (block->mapCount == 0) {
+        VkResult result = vkMapMemory(BP->device, block->memory, 0, VK_WHOLE_SIZE, 0, &block->mapped);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to map device memory!");
+        }
+    }
+    block->mapCount++;
+    return static_cast<char *>(block->mapped) + allocation.offset;
 }
 
-void Model::init(BaseProject *bp, std::string file) {
-    BP = bp;
-    loadModel(file);
-    createVertexBuffer();
-    createIndexBuffer();
+void DeviceMemoryAllocator::unmap(const MemoryAllocation &allocation) {
+    std::lock_guard<std::mutex> lock(mutex);
+    MemoryBlock *block = allocation.block;
+    if (--block->mapCount == 0) {
+        vkUnmapMemory(BP->device, block->memory);
+        block->mapped = nullptr;
+    }
 }
 
-void Model::cleanup() {
-    vkDestroyBuffer(BP->device, indexBuffer, nullptr);
-    vkFreeMemory(BP->device, indexBufferMemory, nullptr);
-    vkDestroyBuffer(BP->device, vertexBuffer, nullptr);
-    vkFreeMemory(BP->device, vertexBufferMemory, nullptr);
+void DeviceMemoryAllocator::cleanup() {
+    for (auto &block: blocks) {
+        if (block->mapped != nullptr) {
+            vkUnmapMemory(BP->device, block->memory);
+        }
+        vkFreeMemory(BP->device, block->memory, nullptr);
+    }
+    blocks.clear();
 }
 
-void Texture::createCubicTextureImage(std::vector<std::string> files) {
-    int texWidth, texHeight, texChannels;
-    stbi_uc *pixels[6];
 
-    /// alloco texture per ognuna delle 6 facce del cubo
-    for (int i = 0; i < 6; i++) {
-        pixels[i] = stbi_load(files[i].c_str(), &texWidth, &texHeight,
-                              &texChannels, STBI_rgb_alpha);
-        if (!pixels[i]) {
-            std::cout << files[i].c_str() << "\n";
-            throw std::runtime_error("failed to load texture image!");
+void Model::loadModel(std::string file, const std::vector<char> &content) {
+    std::string extension = file.substr(file.find_last_of('.') + 1);
+    if (extension == "glb" || extension == "gltf") {
+        loadGLTF(file, content);
+    } else {
+        tinyobj::attrib_t attrib;
+        std::vector<tinyobj::shape_t> shapes;
+        std::vector<tinyobj::material_t> materials;
+        std::string warn, err;
+
+        std::istringstream objStream(std::string(content.begin(), content.end()));
+        tinyobj::MaterialFileReader materialReader("");
+        if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err,
+                              &objStream, &materialReader)) {
+            throw std::runtime_error(warn + err);
+        }
+
+        for (const auto &shape: shapes) {
+            for (const auto &index: shape.mesh.indices) {
+                Vertex vertex{};
+
+                vertex.pos = {
+                        attrib.vertices[3 * index.vertex_index + 0],
+                        attrib.vertices[3 * index.vertex_index + 1],
+                        attrib.vertices[3 * index.vertex_index + 2]
+                };
+
+                vertex.texCoord = {
+                        attrib.texcoords[2 * index.texcoord_index + 0],
+                        1 - attrib.texcoords[2 * index.texcoord_index + 1]
+                };
+
+                vertex.norm = {
+                        attrib.normals[3 * index.normal_index + 0],
+                        attrib.normals[3 * index.normal_index + 1],
+                        attrib.normals[3 * index.normal_index + 2]
+                };
+
+                vertices.push_back(vertex);
+                indices.push_back(vertices.size() - 1);
+            }
         }
     }
 
-    VkDeviceSize imageSize = texWidth * texHeight * 4;
-    VkDeviceSize totalImageSize = texWidth * texHeight * 4 * 6;
-    mipLevels = static_cast<uint32_t>(std::floor(
-            std::log2(std::max(texWidth, texHeight)))) + 1;
+    /// bounding box della mesh, usato per quantizzare le posizioni, e bounding sphere per il culling
+    if (!vertices.empty()) {
+        boundsMin = boundsMax = vertices[0].pos;
+        for (const auto &vertex: vertices) {
+            boundsMin = glm::min(boundsMin, vertex.pos);
+            boundsMax = glm::max(boundsMax, vertex.pos);
+        }
+        boundsCenter = (boundsMin + boundsMax) * 0.5f;
+        boundsRadius = 0.0f;
+        for (const auto &vertex: vertices) {
+            boundsRadius = std::max(boundsRadius, glm::length(vertex.pos - boundsCenter));
+        }
+    }
+}
 
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
+/// callback di tinygltf: l'immagine resta compressa, la decodifica avviene dopo in parallelo
+static bool keepEncodedImage(tinygltf::Image *image, const int, std::string *, std::string *,
+                             int, int, const unsigned char *bytes, int size, void *) {
+    image->image.assign(bytes, bytes + size);
+    image->as_is = true;
+    return true;
+}
 
-    BP->createBuffer(totalImageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                     stagingBuffer, stagingBufferMemory);
-    void *data;
-    vkMapMemory(BP->device, stagingBufferMemory, 0, totalImageSize, 0, &data);
-    for (int i = 0; i < 6; i++) {
-        memcpy(static_cast<char *>(data) + imageSize * i, pixels[i], static_cast<size_t>(imageSize));
+/// legge un accessor glTF come float. Sono accettati anche interi con e senza segno a 8 e 16 bit (dati quantizzati
+/// alla KHR_mesh_quantization): se normalized vengono riportati in [0, 1] o [-1, 1], altrimenti restano il loro valore
+static std::vector<float> readAccessor(const tinygltf::Model &gltf, const tinygltf::Accessor &accessor) {
+    if (accessor.bufferView < 0) {
+        throw std::runtime_error("unsupported glTF accessor without buffer view!");
     }
-    vkUnmapMemory(BP->device, stagingBufferMemory);
+    const tinygltf::BufferView &view = gltf.bufferViews[accessor.bufferView];
+    const unsigned char *base = gltf.buffers[view.buffer].data.data() + view.byteOffset + accessor.byteOffset;
+    int components = tinygltf::GetNumComponentsInType(static_cast<uint32_t>(accessor.type));
+    int stride = accessor.ByteStride(view);
+
+    std::vector<float> values(accessor.count * components);
+    for (size_t i = 0; i < accessor.count; i++) {
+        const unsigned char *element = base + i * stride;
+        for (int c = 0; c < components; c++) {
+            float &value = values[i * components + c];
+            switch (accessor.componentType) {
+                case TINYGLTF_COMPONENT_TYPE_FLOAT:
+                    memcpy(&value, element + c * sizeof(float), sizeof(float));
+                    break;
+                case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT: {
+                    uint16_t component;
+                    memcpy(&component, element + c * sizeof(uint16_t), sizeof(uint16_t));
+                    value = accessor.normalized ? component / 65535.0f : component;
+                    break;
+                }
+                case TINYGLTF_COMPONENT_TYPE_SHORT: {
+                    int16_t component;
+                    memcpy(&component, element + c * sizeof(int16_t), sizeof(int16_t));
+                    value = accessor.normalized ? std::max(component / 32767.0f, -1.0f) : component;
+                    break;
+                }
+                case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+                    value = accessor.normalized ? element[c] / 255.0f : element[c];
+                    break;
+                case TINYGLTF_COMPONENT_TYPE_BYTE: {
+                    auto component = static_cast<int8_t>(element[c]);
+                    value = accessor.normalized ? std::max(component / 127.0f, -1.0f) : component;
+                    break;
+                }
+                default:
+                    throw std::runtime_error("unsupported glTF accessor component type!");
+            }
+        }
+    }
+    return values;
+}
 
-    for (int i = 0; i < 6; i++) {
-        stbi_image_free(pixels[i]);
+static std::vector<uint32_t> readIndices(const tinygltf::Model &gltf, const tinygltf::Accessor &accessor) {
+    const tinygltf::BufferView &view = gltf.bufferViews[accessor.bufferView];
+    const unsigned char *base = gltf.buffers[view.buffer].data.data() + view.byteOffset + accessor.byteOffset;
+    int stride = accessor.ByteStride(view);
+
+    std::vector<uint32_t> values(accessor.count);
+    for (size_t i = 0; i < accessor.count; i++) {
+        const unsigned char *element = base + i * stride;
+        switch (accessor.componentType) {
+            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+                memcpy(&values[i], element, sizeof(uint32_t));
+                break;
+            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT: {
+                uint16_t index;
+                memcpy(&index, element, sizeof(uint16_t));
+                values[i] = index;
+                break;
+            }
+            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+                values[i] = element[0];
+                break;
+            default:
+                throw std::runtime_error("unsupported glTF index component type!");
+        }
     }
-    BP->createSkyBoxImage(texWidth, texHeight, mipLevels, textureImage,
-                          textureImageMemory);
+    return values;
+}
+
+/// carica tutte le primitive a triangoli del file (le trasformazioni dei nodi sono ignorate).
+/// vertices/indices restano popolati per collisioni e bounding box; i buffer binari del file vengono
+/// tenuti cosi' come sono per VERTEX_STREAMS e ogni primitiva punta direttamente ai suoi bufferView
+void Model::loadGLTF(std::string file, const std::vector<char> &content) {
+    tinygltf::TinyGLTF loader;
+    tinygltf::Model gltf;
+    std::string warn, err;
+
+    /// i buffer e le immagini esterni sono relativi alla cartella del file
+    size_t separator = file.find_last_of("/\\");
+    std::string baseDir = separator == std::string::npos ? "" : file.substr(0, separator);
+    loader.SetImageLoader(keepEncodedImage, nullptr);
+    bool loaded = file.substr(file.find_last_of('.') + 1) == "glb" ?
+                  loader.LoadBinaryFromMemory(&gltf, &err, &warn,
+                                              reinterpret_cast<const unsigned char *>(content.data()),
+                                              static_cast<unsigned int>(content.size()), baseDir) :
+                  loader.LoadASCIIFromString(&gltf, &err, &warn, content.data(),
+                                             static_cast<unsigned int>(content.size()), baseDir);
+    if (!loaded) {
+        throw std::runtime_error(warn + err);
+    }
+
+    /// le immagini incorporate vengono decodificate in parallelo mentre si leggono le mesh
+    std::vector<std::future<void>> decodedImages;
+    for (auto &image: gltf.images) {
+        decodedImages.push_back(std::async(std::launch::async, [&image]() {
+            int texWidth, texHeight, texChannels;
+            stbi_uc *pixels = stbi_load_from_memory(image.image.data(), static_cast<int>(image.image.size()),
+                                                    &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
+            if (!pixels) {
+                throw std::runtime_error("failed to load texture image!");
+            }
+            image.width = texWidth;
+            image.height = texHeight;
+            image.component = 4;
+            image.bits = 8;
+            image.image.assign(pixels, pixels + texWidth * texHeight * 4);
+            image.as_is = false;
+            stbi_image_free(pixels);
+        }));
+    }
+
+    /// offset di ogni buffer nel VkBuffer finale, allineati a 16 byte
+    VkDeviceSize streamSize = 0;
+    std::vector<std::vector<unsigned char>> convertedStreams;
+    auto appendStream = [&](const void *src, size_t size) {
+        streamSize = (streamSize + 15) & ~static_cast<VkDeviceSize>(15);
+        VkDeviceSize offset = streamSize;
+        streamBufferOffsets.push_back(offset);
+        convertedStreams.emplace_back(static_cast<const unsigned char *>(src),
+                                      static_cast<const unsigned char *>(src) + size);
+        streamSize += size;
+        return offset;
+    };
+    for (const auto &buffer: gltf.buffers) {
+        streamSize = (streamSize + 15) & ~static_cast<VkDeviceSize>(15);
+        streamBufferOffsets.push_back(streamSize);
+        streamSize += buffer.data.size();
+    }
+
+    /// un attributo gia' float e compatto si usa direttamente, altrimenti si aggiunge la versione convertita
+    auto attributeOffset = [&](int accessorIndex, int components, const std::vector<float> &values) {
+        if (accessorIndex >= 0) {
+            const tinygltf::Accessor &accessor = gltf.accessors[accessorIndex];
+            const tinygltf::BufferView &view = gltf.bufferViews[accessor.bufferView];
+            if (accessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT &&
+                accessor.ByteStride(view) == components * static_cast<int>(sizeof(float))) {
+                return streamBufferOffsets[view.buffer] + view.byteOffset + accessor.byteOffset;
+            }
+        }
+        return appendStream(values.data(), values.size() * sizeof(float));
+    };
+
+    for (const auto &mesh: gltf.meshes) {
+        for (const auto &primitive: mesh.primitives) {
+            auto position = primitive.attributes.find("POSITION");
+            if (primitive.mode != TINYGLTF_MODE_TRIANGLES || position == primitive.attributes.end()) {
+                continue;
+            }
+            auto normal = primitive.attributes.find("NORMAL");
+            auto texCoord = primitive.attributes.find("TEXCOORD_0");
+            int normalAccessor = normal != primitive.attributes.end() ? normal->second : -1;
+            int texCoordAccessor = texCoord != primitive.attributes.end() ? texCoord->second : -1;
+
+            size_t vertexCount = gltf.accessors[position->second].count;
+            std::vector<float> pos = readAccessor(gltf, gltf.accessors[position->second]);
+            std::vector<float> norm = normalAccessor >= 0 ?
+                                      readAccessor(gltf, gltf.accessors[normalAccessor]) :
+                                      std::vector<float>(vertexCount * 3, 0.0f);
+            std::vector<float> uv = texCoordAccessor >= 0 ?
+                                    readAccessor(gltf, gltf.accessors[texCoordAccessor]) :
+                                    std::vector<float>(vertexCount * 2, 0.0f);
+
+            std::vector<uint32_t> primitiveIndices;
+            if (primitive.indices >= 0) {
+                primitiveIndices = readIndices(gltf, gltf.accessors[primitive.indices]);
+            } else {
+                for (uint32_t i = 0; i < vertexCount; i++) {
+                    primitiveIndices.push_back(i);
+                }
+            }
+
+            /// copia su CPU: le coordinate texture glTF hanno gia' l'origine in alto a sinistra
+            auto firstVertex = static_cast<uint32_t>(vertices.size());
+            for (size_t i = 0; i < vertexCount; i++) {
+                Vertex vertex{};
+                vertex.pos = {pos[3 * i + 0], pos[3 * i + 1], pos[3 * i + 2]};
+                vertex.norm = {norm[3 * i + 0], norm[3 * i + 1], norm[3 * i + 2]};
+                vertex.texCoord = {uv[2 * i + 0], uv[2 * i + 1]};
+                vertices.push_back(vertex);
+            }
+            for (uint32_t index: primitiveIndices) {
+                indices.push_back(firstVertex + index);
+            }
+
+            int image = -1;
+            if (primitive.material >= 0) {
+                int texture = gltf.materials[primitive.material].pbrMetallicRoughness.baseColorTexture.index;
+                if (texture >= 0) {
+                    image = gltf.textures[texture].source;
+                }
+            }
+            if (baseColorImage < 0) {
+                baseColorImage = image;
+            }
+
+            SubMesh subMesh{};
+            subMesh.posOffset = attributeOffset(position->second, 3, pos);
+            subMesh.normOffset = attributeOffset(normalAccessor, 3, norm);
+            subMesh.uvOffset = attributeOffset(texCoordAccessor, 2, uv);
+            subMesh.indexCount = static_cast<uint32_t>(primitiveIndices.size());
+            subMesh.image = image;
+
+            int indexComponentType = primitive.indices >= 0 ?
+                                     gltf.accessors[primitive.indices].componentType : -1;
+            if (indexComponentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT ||
+                indexComponentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT) {
+                const tinygltf::Accessor &accessor = gltf.accessors[primitive.indices];
+                const tinygltf::BufferView &view = gltf.bufferViews[accessor.bufferView];
+                subMesh.indexOffset = streamBufferOffsets[view.buffer] + view.byteOffset + accessor.byteOffset;
+                subMesh.indexType = indexComponentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT ?
+                                    VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+            } else {
+                subMesh.indexOffset = appendStream(primitiveIndices.data(),
+                                                   primitiveIndices.size() * sizeof(uint32_t));
+                subMesh.indexType = VK_INDEX_TYPE_UINT32;
+            }
+            subMeshes.push_back(subMesh);
+        }
+    }
+
+    for (auto &buffer: gltf.buffers) {
+        streamBuffers.push_back(std::move(buffer.data));
+    }
+    for (auto &stream: convertedStreams) {
+        streamBuffers.push_back(std::move(stream));
+    }
+
+    for (auto &decodedImage: decodedImages) {
+        decodedImage.get();
+    }
+    images = std::move(gltf.images);
+}
+
+// Lesson 21
+void Model::createVertexBuffer() {
+    std::vector<PackedVertex> packedVertices;
+    const void *src = vertices.data();
+    VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
+
+    if (vertexFormat == VERTEX_PACKED) {
+        glm::vec3 extent = boundsMax - boundsMin;
+        extent = glm::vec3(extent.x > 0.0f ? extent.x : 1.0f,
+                           extent.y > 0.0f ? extent.y : 1.0f,
+                           extent.z > 0.0f ? extent.z : 1.0f);
+        posOffset = glm::vec4(boundsMin, 0.0f);
+        posScale = glm::vec4(extent, 1.0f);
+
+        packedVertices.reserve(vertices.size());
+        for (const auto &vertex: vertices) {
+            packedVertices.push_back(PackedVertex::pack(vertex, boundsMin, extent));
+        }
+        src = packedVertices.data();
+        bufferSize = sizeof(packedVertices[0]) * packedVertices.size();
+    }
+
+    BP->createGeometryBuffer(src, bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                             vertexBuffer, vertexBufferMemory);
+}
+
+void Model::createIndexBuffer() {
+    std::vector<uint16_t> shortIndices;
+    const void *src = indices.data();
+    VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
+    indexType = VK_INDEX_TYPE_UINT32;
+
+    /// con il formato compresso gli indici scendono a 16 bit se la mesh ha meno di 65k vertici
+    if (vertexFormat == VERTEX_PACKED && vertices.size() <= UINT16_MAX) {
+        shortIndices.assign(indices.begin(), indices.end());
+        src = shortIndices.data();
+        bufferSize = sizeof(shortIndices[0]) * shortIndices.size();
+        indexType = VK_INDEX_TYPE_UINT16;
+    }
+
+    BP->createGeometryBuffer(src, bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                             indexBuffer, indexBufferMemory);
+}
+
+/// VERTEX_STREAMS: i buffer glTF vengono copiati senza conversione, attributi e indici nello stesso VkBuffer
+void Model::createStreamBuffer() {
+    if (streamBuffers.empty()) {
+        throw std::runtime_error("glTF model has no triangle primitives!");
+    }
+    VkDeviceSize bufferSize = streamBufferOffsets.back() + streamBuffers.back().size();
+
+    std::vector<char> data(static_cast<size_t>(bufferSize));
+    for (size_t i = 0; i < streamBuffers.size(); i++) {
+        memcpy(data.data() + streamBufferOffsets[i], streamBuffers[i].data(), streamBuffers[i].size());
+    }
+    BP->createGeometryBuffer(data.data(), bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                                                      VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                             vertexBuffer, vertexBufferMemory);
+
+    streamBuffers.clear();
+    streamBuffers.shrink_to_fit();
+}
+
+/// divide l'index buffer in meshlet di triangoli consecutivi: un meshlet si chiude a MESHLET_MAX_TRIANGLES
+/// oppure, superati MESHLET_MIN_TRIANGLES, quando il triangolo successivo allargherebbe troppo il cono delle normali
+void Model::createMeshlets() {
+    meshlets.clear();
+    auto triangleCount = static_cast<uint32_t>(indices.size() / 3);
+
+    auto faceNormal = [&](uint32_t triangle) {
+        glm::vec3 a = vertices[indices[3 * triangle + 0]].pos;
+        glm::vec3 b = vertices[indices[3 * triangle + 1]].pos;
+        glm::vec3 c = vertices[indices[3 * triangle + 2]].pos;
+        glm::vec3 n = glm::cross(b - a, c - a);
+        float length = glm::length(n);
+        return length > 0.0f ? n / length : glm::vec3(0.0f);
+    };
+
+    uint32_t first = 0;
+    while (first < triangleCount) {
+        uint32_t last = first;
+        glm::vec3 normalSum = glm::vec3(0.0f);
+        while (last < triangleCount && last - first < MESHLET_MAX_TRIANGLES) {
+            glm::vec3 n = faceNormal(last);
+            if (last - first >= MESHLET_MIN_TRIANGLES && glm::length(normalSum) > 0.0f &&
+                glm::dot(glm::normalize(normalSum), n) < 0.5f) {
+                break;
+            }
+            normalSum += n;
+            last++;
+        }
+
+        Meshlet meshlet{};
+        meshlet.firstIndex = 3 * first;
+        meshlet.indexCount = 3 * (last - first);
+
+        /// sfera centrata nel bounding box dei vertici del meshlet
+        glm::vec3 minPos = vertices[indices[meshlet.firstIndex]].pos;
+        glm::vec3 maxPos = minPos;
+        for (uint32_t i = meshlet.firstIndex; i < meshlet.firstIndex + meshlet.indexCount; i++) {
+            minPos = glm::min(minPos, vertices[indices[i]].pos);
+            maxPos = glm::max(maxPos, vertices[indices[i]].pos);
+        }
+        meshlet.center = 0.5f * (minPos + maxPos);
+        for (uint32_t i = meshlet.firstIndex; i < meshlet.firstIndex + meshlet.indexCount; i++) {
+            meshlet.radius = std::max(meshlet.radius, glm::distance(meshlet.center, vertices[indices[i]].pos));
+        }
+
+        /// cono delle normali: coneCutoff e' il seno del semi-angolo, 2 disabilita il test (normali oltre 90 gradi)
+        meshlet.coneAxis = glm::length(normalSum) > 0.0f ? glm::normalize(normalSum) : glm::vec3(0.0f, 1.0f, 0.0f);
+        float minDot = 1.0f;
+        for (uint32_t triangle = first; triangle < last; triangle++) {
+            minDot = std::min(minDot, glm::dot(meshlet.coneAxis, faceNormal(triangle)));
+        }
+        meshlet.coneCutoff = minDot > 0.0f ? std::sqrt(1.0f - minDot * minDot) : 2.0f;
+
+        meshlets.push_back(meshlet);
+        first = last;
+    }
+}
+
+/// scarta i meshlet fuori dal frustum o completamente rivolti all'indietro, scrive in commands i range di indici
+/// rimasti (unendo quelli contigui) e ne restituisce il numero; i comandi successivi non vengono toccati.
+/// I test sono fatti nello spazio del modello
+uint32_t Model::cullMeshlets(VkDrawIndexedIndirectCommand *commands, const glm::mat4 &worldMatrix,
+                             const glm::mat4 &viewProj, glm::vec3 cameraPosition) const {
+    /// piani del frustum in coordinate del modello, dalla matrice model-view-projection
+    glm::vec4 planes[6];
+    frustumPlanes(viewProj * worldMatrix, planes);
+    glm::vec3 eye = glm::vec3(glm::inverse(worldMatrix) * glm::vec4(cameraPosition, 1.0f));
+
+    uint32_t drawCount = 0;
+    for (const auto &meshlet: meshlets) {
+        bool visible = true;
+        for (const auto &plane: planes) {
+            if (glm::dot(glm::vec3(plane), meshlet.center) + plane.w < -meshlet.radius) {
+                visible = false;
+                break;
+            }
+        }
+        glm::vec3 toCenter = meshlet.center - eye;
+        if (visible && glm::dot(toCenter, meshlet.coneAxis) >=
+                       meshlet.coneCutoff * glm::length(toCenter) + meshlet.radius) {
+            visible = false;
+        }
+        if (!visible) {
+            continue;
+        }
+
+        if (drawCount > 0 &&
+            commands[drawCount - 1].firstIndex + commands[drawCount - 1].indexCount == meshlet.firstIndex) {
+            commands[drawCount - 1].indexCount += meshlet.indexCount;
+        } else {
+            commands[drawCount++] = {meshlet.indexCount, 1, meshlet.firstIndex, 0, 0};
+        }
+    }
+    return drawCount;
+}
+
+/// parte su CPU del caricamento, senza chiamate Vulkan: puo' essere eseguita su un thread separato prima di init()
+void Model::load(std::string file, std::vector<char> content) {
+    if (content.empty()) {
+        content = Pipeline::readFile(file);
+    }
+    loadModel(file, content);
+    createMeshlets();
+}
+
+void Model::init(BaseProject *bp, std::string file, VertexFormat format) {
+    /// modello condiviso tramite AssetCache e gia' caricato su GPU da un'altra istanza
+    if (vertexBuffer != VK_NULL_HANDLE) {
+        if (format != vertexFormat) {
+            throw std::runtime_error("shared model already uploaded with a different vertex format!");
+        }
+        return;
+    }
+
+    BP = bp;
+    vertexFormat = format;
+    if (vertices.empty()) {
+        load(file);
+    }
+    if (vertexFormat == VERTEX_STREAMS) {
+        if (subMeshes.empty()) {
+            throw std::runtime_error("VERTEX_STREAMS requires a glTF model!");
+        }
+        createStreamBuffer();
+    } else {
+        streamBuffers.clear();
+        createVertexBuffer();
+        createIndexBuffer();
+    }
+}
+
+void Model::cleanup() {
+    vkDestroyBuffer(BP->device, indexBuffer, nullptr);
+    BP->memoryAllocator.free(indexBufferMemory);
+    vkDestroyBuffer(BP->device, vertexBuffer, nullptr);
+    BP->memoryAllocator.free(vertexBufferMemory);
+}
+
+void MeshletDrawList::init(BaseProject *bp, const Model *m) {
+    BP = bp;
+    model = m;
+    commandCount = 0;
+    if (model->meshlets.empty() || model->vertexFormat == VERTEX_STREAMS) {
+        return;
+    }
+    commandCount = static_cast<uint32_t>(model->meshlets.size());
+    firstCommand = BP->indirectDrawBuffer.reserveCommands(commandCount);
+    countIndex = BP->indirectDrawBuffer.reserveCount();
+    BP->indirectDrawBuffer.drawLists.push_back(this);
+    /// il culling precede sempre la registrazione del frame: fino ad allora non c'e' niente da disegnare
+    drawCounts.assign(BP->swapChainImages.size(), 0);
+}
+
+void MeshletDrawList::cull(uint32_t currentImage, const glm::mat4 &worldMatrix, const glm::mat4 &viewProj,
+                           glm::vec3 cameraPosition) {
+    if (commandCount == 0) {
+        return;
+    }
+    /// i comandi e il contatore vengono scritti dal compute shader
+    if (BP->gpuCulling.enabled) {
+        BP->gpuCulling.setObject(currentImage, *this, worldMatrix, cameraPosition);
+        return;
+    }
+    IndirectDrawBuffer &indirectDrawBuffer = BP->indirectDrawBuffer;
+    drawCounts[currentImage] = model->cullMeshlets(indirectDrawBuffer.commands[currentImage] + firstCommand,
+                                                   worldMatrix, viewProj, cameraPosition);
+    indirectDrawBuffer.counts[currentImage][countIndex] = drawCounts[currentImage];
+}
+
+/// CULL_PHASE_LATE esiste solo con il culling su GPU, quindi con vkCmdDrawIndexedIndirectCount
+void MeshletDrawList::draw(VkCommandBuffer commandBuffer, uint32_t currentImage, CullPhase phase) {
+    VkBuffer buffer = BP->indirectDrawBuffer.buffers[currentImage];
+    VkDeviceSize offset = BP->indirectDrawBuffer.commandOffset(*this, phase);
+    if (BP->drawIndirectCount) {
+        BP->cmdDrawIndexedIndirectCount(commandBuffer, buffer, offset,
+                                        buffer, BP->indirectDrawBuffer.countOffset(*this, phase),
+                                        commandCount, sizeof(VkDrawIndexedIndirectCommand));
+    } else if (BP->multiDrawIndirect) {
+        if (drawCounts[currentImage] > 0) {
+            vkCmdDrawIndexedIndirect(commandBuffer, buffer, offset, drawCounts[currentImage],
+                                     sizeof(VkDrawIndexedIndirectCommand));
+        }
+    } else {
+        for (uint32_t i = 0; i < drawCounts[currentImage]; i++) {
+            vkCmdDrawIndexedIndirect(commandBuffer, buffer,
+                                     offset + i * sizeof(VkDrawIndexedIndirectCommand), 1,
+                                     sizeof(VkDrawIndexedIndirectCommand));
+        }
+    }
+}
+
+/// l'intervallo riservato viene liberato insieme a tutto l'IndirectDrawBuffer
+void MeshletDrawList::cleanup() {
+    commandCount = 0;
+    drawCounts.clear();
+}
+
+void IndirectDrawBuffer::init(BaseProject *bp) {
+    BP = bp;
+    reservedCommands = 0;
+    reservedCounts = 0;
+}
+
+uint32_t IndirectDrawBuffer::reserveCommands(uint32_t commandCount) {
+    if (!buffers.empty()) {
+        throw std::runtime_error("indirect draw buffer already created!");
+    }
+    uint32_t firstCommand = reservedCommands;
+    reservedCommands += commandCount;
+    return firstCommand;
+}
+
+uint32_t IndirectDrawBuffer::reserveCount() {
+    return reservedCounts++;
+}
+
+void IndirectDrawBuffer::create() {
+    if (reservedCommands == 0) {
+        return;
+    }
+    phases = BP->gpuCulling.enabled ? 2 : 1;
+    VkDeviceSize bufferSize = countOffset(phases * reservedCounts);
+    buffers.resize(BP->swapChainImages.size());
+    buffersMemory.resize(BP->swapChainImages.size());
+    commands.resize(BP->swapChainImages.size());
+    counts.resize(BP->swapChainImages.size());
+    for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
+        BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                         buffers[i], buffersMemory[i]);
+        char *data = static_cast<char *>(BP->memoryAllocator.map(buffersMemory[i]));
+        memset(data, 0, (size_t) bufferSize);
+        commands[i] = reinterpret_cast<VkDrawIndexedIndirectCommand *>(data);
+        counts[i] = reinterpret_cast<uint32_t *>(data + countOffset(0));
+    }
+}
+
+/// i contatori iniziano a un multiplo di 256 byte (il massimo di minStorageBufferOffsetAlignment): GpuCulling li
+/// lega come storage buffer separato dai comandi
+VkDeviceSize IndirectDrawBuffer::countOffset(uint32_t countIndex) const {
+    VkDeviceSize commandsSize = phases * reservedCommands * sizeof(VkDrawIndexedIndirectCommand);
+    return (commandsSize + 255) / 256 * 256 + countIndex * sizeof(uint32_t);
+}
+
+VkDeviceSize IndirectDrawBuffer::commandOffset(const MeshletDrawList &drawList, CullPhase phase) const {
+    uint32_t command = drawList.firstCommand + (phase == CULL_PHASE_LATE ? reservedCommands : 0);
+    return command * sizeof(VkDrawIndexedIndirectCommand);
+}
+
+VkDeviceSize IndirectDrawBuffer::countOffset(const MeshletDrawList &drawList, CullPhase phase) const {
+    return countOffset(drawList.countIndex + (phase == CULL_PHASE_LATE ? reservedCounts : 0));
+}
+
+void IndirectDrawBuffer::cleanup() {
+    for (size_t i = 0; i < buffers.size(); i++) {
+        BP->memoryAllocator.unmap(buffersMemory[i]);
+        vkDestroyBuffer(BP->device, buffers[i], nullptr);
+        BP->memoryAllocator.free(buffersMemory[i]);
+    }
+    buffers.clear();
+    buffersMemory.clear();
+    commands.clear();
+    counts.clear();
+    drawLists.clear();
+    reservedCommands = 0;
+    reservedCounts = 0;
+    phases = 1;
+}
+
+void GpuCulling::init(BaseProject *bp) {
+    BP = bp;
+    VkFormatProperties depthProperties;
+    vkGetPhysicalDeviceFormatProperties(BP->physicalDevice, VK_FORMAT_D32_SFLOAT, &depthProperties);
+    enabled = GPU_CULLING && BP->drawIndirectCount &&
+              (depthProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) != 0;
+    if (!enabled) {
+        return;
+    }
+
+    cullSetLayout.init(BP, {
+            {0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,         VK_SHADER_STAGE_COMPUTE_BIT},
+            {1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,         VK_SHADER_STAGE_COMPUTE_BIT},
+            {2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,         VK_SHADER_STAGE_COMPUTE_BIT},
+            {3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,         VK_SHADER_STAGE_COMPUTE_BIT},
+            {4, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT},
+            {5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,         VK_SHADER_STAGE_COMPUTE_BIT}
+    });
+    pyramidSetLayout.init(BP, {
+            {0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT},
+            {1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,          VK_SHADER_STAGE_COMPUTE_BIT}
+    });
+    /// la CullPhase
+    createPipeline("shaders/cullMeshletsComp.spv", cullSetLayout.descriptorSetLayout, sizeof(uint32_t),
+                   cullPipelineLayout, cullPipeline);
+    /// dimensione del livello letto e di quello scritto
+    createPipeline("shaders/depthPyramidComp.spv", pyramidSetLayout.descriptorSetLayout, 4 * sizeof(uint32_t),
+                   pyramidPipelineLayout, pyramidPipeline);
+
+    /// la piramide viene letta solo con texelFetch: nessun filtro
+    VkSamplerCreateInfo samplerInfo{};
+    samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    samplerInfo.magFilter = VK_FILTER_NEAREST;
+    samplerInfo.minFilter = VK_FILTER_NEAREST;
+    samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+
+    VkResult result = vkCreateSampler(BP->device, &samplerInfo, nullptr, &sampler);
+    if (result != VK_SUCCESS) {
+        PrintVkError(result);
+        throw std::runtime_error("failed to create depth pyramid sampler!");
+    }
+}
 
-    BP->transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
-                              VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels, 6);
-    BP->copyBufferToImage(stagingBuffer, textureImage,
-                          static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight), 6);
+void GpuCulling::createPipeline(const std::string &file, VkDescriptorSetLayout setLayout,
+                                uint32_t pushConstantsSize, VkPipelineLayout &pipelineLayout,
+                                VkPipeline &pipeline) {
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = pushConstantsSize;
 
-    BP->generateMipmaps(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
-                        texWidth, texHeight, mipLevels, 6);
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &setLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = pushConstantsSize > 0 ? 1 : 0;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+    VkResult result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr, &pipelineLayout);
+    if (result != VK_SUCCESS) {
+        PrintVkError(result);
+        throw std::runtime_error("failed to create pipeline layout!");
+    }
+
+    std::vector<char> code = Pipeline::readFile(file);
+    VkShaderModuleCreateInfo moduleInfo{};
+    moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    moduleInfo.codeSize = code.size();
+    moduleInfo.pCode = reinterpret_cast<const uint32_t *>(code.data());
+
+    VkShaderModule shaderModule;
+    result = vkCreateShaderModule(BP->device, &moduleInfo, nullptr, &shaderModule);
+    if (result != VK_SUCCESS) {
+        PrintVkError(result);
+        throw std::runtime_error("failed to create shader module!");
+    }
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = shaderModule;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = pipelineLayout;
+
+    result = vkCreateComputePipelines(BP->device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline);
+    vkDestroyShaderModule(BP->device, shaderModule, nullptr);
+    if (result != VK_SUCCESS) {
+        PrintVkError(result);
+        throw std::runtime_error("failed to create compute pipeline!");
+    }
+}
+
+void GpuCulling::create() {
+    IndirectDrawBuffer &indirectDrawBuffer = BP->indirectDrawBuffer;
+    if (!enabled || indirectDrawBuffer.buffers.empty()) {
+        return;
+    }
+    uint32_t imageCount = static_cast<uint32_t>(BP->swapChainImages.size());
+
+    /// i meshlet di tutte le liste, nell'ordine dei loro comandi
+    std::vector<GpuMeshlet> meshlets;
+    for (auto drawList: indirectDrawBuffer.drawLists) {
+        for (uint32_t i = 0; i < drawList->commandCount; i++) {
+            const Meshlet &meshlet = drawList->model->meshlets[i];
+            meshlets.push_back({glm::vec4(meshlet.center, meshlet.radius),
+                                glm::vec4(meshlet.coneAxis, meshlet.coneCutoff),
+                                meshlet.firstIndex, meshlet.indexCount, drawList->countIndex, i});
+        }
+    }
+    meshletCount = static_cast<uint32_t>(meshlets.size());
+    VkDeviceSize meshletsSize = meshlets.size() * sizeof(GpuMeshlet);
+    BP->createBuffer(meshletsSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     meshletBuffer, meshletBufferMemory);
+    memcpy(BP->memoryAllocator.map(meshletBufferMemory), meshlets.data(), (size_t) meshletsSize);
+    BP->memoryAllocator.unmap(meshletBufferMemory);
+
+    /// scritti dalla CPU in ogni frame e letti dopo il fence: restano mappati
+    VkDeviceSize frameSize = sizeof(GpuCullFrame) + indirectDrawBuffer.reservedCounts * sizeof(GpuCullObject);
+    frameBuffers.resize(imageCount);
+    frameBuffersMemory.resize(imageCount);
+    frames.resize(imageCount);
+    for (uint32_t i = 0; i < imageCount; i++) {
+        BP->createBuffer(frameSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                         frameBuffers[i], frameBuffersMemory[i]);
+        void *data = BP->memoryAllocator.map(frameBuffersMemory[i]);
+        memset(data, 0, (size_t) frameSize);
+        frames[i] = static_cast<GpuCullFrame *>(data);
+    }
+
+    /// scritti e letti solo dal compute shader: la prima fase scrive il flag di ogni meshlet
+    VkDeviceSize retestSize = meshletCount * sizeof(uint32_t);
+    retestBuffers.resize(imageCount);
+    retestBuffersMemory.resize(imageCount);
+    for (uint32_t i = 0; i < imageCount; i++) {
+        BP->createBuffer(retestSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                         retestBuffers[i], retestBuffersMemory[i]);
+    }
+
+    /// piramide alla risoluzione del depth buffer, fino a 1x1; resta sempre in layout GENERAL
+    pyramidWidth = BP->swapChainExtent.width;
+    pyramidHeight = BP->swapChainExtent.height;
+    pyramidLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(pyramidWidth, pyramidHeight)))) + 1;
+    BP->createImage(pyramidWidth, pyramidHeight, pyramidLevels, VK_FORMAT_R32_SFLOAT, VK_IMAGE_TILING_OPTIMAL,
+                    VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, pyramidImage, pyramidImageMemory);
+    pyramidView = BP->createImageView(pyramidImage, VK_FORMAT_R32_SFLOAT, VK_IMAGE_ASPECT_COLOR_BIT,
+                                      pyramidLevels, VK_IMAGE_VIEW_TYPE_2D, 1);
+    pyramidLevelViews.resize(pyramidLevels);
+    for (uint32_t level = 0; level < pyramidLevels; level++) {
+        VkImageViewCreateInfo viewInfo{};
+        viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        viewInfo.image = pyramidImage;
+        viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        viewInfo.format = VK_FORMAT_R32_SFLOAT;
+        viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        viewInfo.subresourceRange.baseMipLevel = level;
+        viewInfo.subresourceRange.levelCount = 1;
+        viewInfo.subresourceRange.baseArrayLayer = 0;
+        viewInfo.subresourceRange.layerCount = 1;
+
+        VkResult result = vkCreateImageView(BP->device, &viewInfo, nullptr, &pyramidLevelViews[level]);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create depth pyramid image view!");
+        }
+    }
+
+    VkCommandBuffer commandBuffer = BP->beginSingleTimeCommands();
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = pyramidImage;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = pyramidLevels;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 0, nullptr, 0, nullptr, 1, &barrier);
+    BP->endSingleTimeCommands(commandBuffer);
+    pyramidReady = false;
+
+    std::array<VkDescriptorPoolSize, 3> poolSizes{};
+    poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSizes[0].descriptorCount = 5 * imageCount;
+    poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    poolSizes[1].descriptorCount = imageCount + pyramidLevels;
+    poolSizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    poolSizes[2].descriptorCount = pyramidLevels;
+
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+    poolInfo.pPoolSizes = poolSizes.data();
+    poolInfo.maxSets = imageCount + pyramidLevels;
+
+    VkResult result = vkCreateDescriptorPool(BP->device, &poolInfo, nullptr, &descriptorPool);
+    if (result != VK_SUCCESS) {
+        PrintVkError(result);
+        throw std::runtime_error("failed to create descriptor pool!");
+    }
+
+    std::vector<VkDescriptorSetLayout> cullLayouts(imageCount, cullSetLayout.descriptorSetLayout);
+    std::vector<VkDescriptorSetLayout> pyramidLayouts(pyramidLevels, pyramidSetLayout.descriptorSetLayout);
+    cullSets.resize(imageCount);
+    pyramidSets.resize(pyramidLevels);
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = descriptorPool;
+    allocInfo.descriptorSetCount = imageCount;
+    allocInfo.pSetLayouts = cullLayouts.data();
+    result = vkAllocateDescriptorSets(BP->device, &allocInfo, cullSets.data());
+    if (result == VK_SUCCESS) {
+        allocInfo.descriptorSetCount = pyramidLevels;
+        allocInfo.pSetLayouts = pyramidLayouts.data();
+        result = vkAllocateDescriptorSets(BP->device, &allocInfo, pyramidSets.data());
+    }
+    if (result != VK_SUCCESS) {
+        PrintVkError(result);
+        throw std::runtime_error("failed to allocate descriptor sets!");
+    }
+
+    VkDescriptorImageInfo pyramidInfo{sampler, pyramidView, VK_IMAGE_LAYOUT_GENERAL};
+    for (uint32_t i = 0; i < imageCount; i++) {
+        /// comandi e contatori di entrambe le fasi
+        std::array<VkDescriptorBufferInfo, 5> bufferInfos = {{
+                {meshletBuffer, 0, meshletsSize},
+                {frameBuffers[i], 0, frameSize},
+                {indirectDrawBuffer.buffers[i], 0, indirectDrawBuffer.countOffset(0)},
+                {indirectDrawBuffer.buffers[i], indirectDrawBuffer.countOffset(0),
+                 indirectDrawBuffer.phases * indirectDrawBuffer.reservedCounts * sizeof(uint32_t)},
+                {retestBuffers[i], 0, retestSize}
+        }};
+        std::array<VkWriteDescriptorSet, 6> descriptorWrites{};
+        for (uint32_t j = 0; j < descriptorWrites.size(); j++) {
+            descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrites[j].dstSet = cullSets[i];
+            descriptorWrites[j].dstBinding = j;
+            descriptorWrites[j].dstArrayElement = 0;
+            descriptorWrites[j].descriptorCount = 1;
+            if (j == 4) {
+                descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+                descriptorWrites[j].pImageInfo = &pyramidInfo;
+            } else {
+                descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+                descriptorWrites[j].pBufferInfo = &bufferInfos[j < 4 ? j : j - 1];
+            }
+        }
+        vkUpdateDescriptorSets(BP->device, static_cast<uint32_t>(descriptorWrites.size()),
+                               descriptorWrites.data(), 0, nullptr);
+    }
+
+    /// il livello 0 legge il depth buffer, gli altri il livello precedente
+    for (uint32_t level = 0; level < pyramidLevels; level++) {
+        VkDescriptorImageInfo sourceInfo = level == 0 ?
+                VkDescriptorImageInfo{sampler, BP->depthImageView, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL} :
+                VkDescriptorImageInfo{sampler, pyramidLevelViews[level - 1], VK_IMAGE_LAYOUT_GENERAL};
+        VkDescriptorImageInfo destinationInfo{VK_NULL_HANDLE, pyramidLevelViews[level], VK_IMAGE_LAYOUT_GENERAL};
+        std::array<VkWriteDescriptorSet, 2> descriptorWrites{};
+        for (uint32_t j = 0; j < descriptorWrites.size(); j++) {
+            descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrites[j].dstSet = pyramidSets[level];
+            descriptorWrites[j].dstBinding = j;
+            descriptorWrites[j].dstArrayElement = 0;
+            descriptorWrites[j].descriptorCount = 1;
+        }
+        descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptorWrites[0].pImageInfo = &sourceInfo;
+        descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        descriptorWrites[1].pImageInfo = &destinationInfo;
+        vkUpdateDescriptorSets(BP->device, static_cast<uint32_t>(descriptorWrites.size()),
+                               descriptorWrites.data(), 0, nullptr);
+    }
+}
+
+void GpuCulling::beginFrame(uint32_t currentImage, const glm::mat4 &view, const glm::mat4 &proj) {
+    if (frames.empty()) {
+        return;
+    }
+    /// il fence dell'immagine e' gia' segnalato: le statistiche sono quelle dell'ultimo frame che l'ha usata
+    GpuCullFrame *frame = frames[currentImage];
+    if (frame->objectCount > 0) {
+        statsFrames++;
+        objectsCulled += frame->objectsCulled;
+        meshletsDrawn += frame->meshletsDrawn;
+        meshletsOccluded += frame->meshletsOccluded;
+        meshletsLate += frame->meshletsLate;
+    }
+
+    IndirectDrawBuffer &indirectDrawBuffer = BP->indirectDrawBuffer;
+    uint32_t objectCount = indirectDrawBuffer.reservedCounts;
+    frustumPlanes(proj * view, frame->planes);
+    frame->previousView = previousView;
+    frame->previousProj = previousProj;
+    frame->view = view;
+    frame->proj = proj;
+    frame->pyramid = glm::vec4(pyramidWidth, pyramidHeight, pyramidLevels, pyramidReady ? 1.0f : 0.0f);
+    frame->objectCount = objectCount;
+    frame->meshletCount = meshletCount;
+    frame->commandCount = indirectDrawBuffer.reservedCommands;
+    frame->objectsCulled = 0;
+    frame->meshletsDrawn = 0;
+    frame->meshletsOccluded = 0;
+    frame->meshletsLate = 0;
+    GpuCullObject *objects = reinterpret_cast<GpuCullObject *>(frame + 1);
+    for (uint32_t i = 0; i < objectCount; i++) {
+        objects[i].sphere.w = -1.0f;
+    }
+    memset(indirectDrawBuffer.counts[currentImage], 0,
+           indirectDrawBuffer.phases * objectCount * sizeof(uint32_t));
+
+    /// la piramide registrata in questo frame, dopo il primo render pass, sara' usata dal prossimo
+    previousView = view;
+    previousProj = proj;
+}
+
+void GpuCulling::setObject(uint32_t currentImage, const MeshletDrawList &drawList, const glm::mat4 &worldMatrix,
+                           glm::vec3 cameraPosition) {
+    if (frames.empty()) {
+        return;
+    }
+    GpuCullObject &object = reinterpret_cast<GpuCullObject *>(frames[currentImage] + 1)[drawList.countIndex];
+    float scale = std::max({glm::length(glm::vec3(worldMatrix[0])), glm::length(glm::vec3(worldMatrix[1])),
+                            glm::length(glm::vec3(worldMatrix[2]))});
+    object.world = worldMatrix;
+    object.sphere = glm::vec4(glm::vec3(worldMatrix * glm::vec4(drawList.model->boundsCenter, 1.0f)),
+                              drawList.model->boundsRadius * scale);
+    object.eye = glm::vec4(glm::vec3(glm::inverse(worldMatrix) * glm::vec4(cameraPosition, 1.0f)), scale);
+    object.firstCommand = drawList.firstCommand;
+    object.countIndex = drawList.countIndex;
+}
+
+void GpuCulling::recordCull(VkCommandBuffer commandBuffer, uint32_t currentImage, CullPhase phase) {
+    if (cullSets.empty()) {
+        return;
+    }
+    /// la piramide e' stata scritta dal frame precedente, o da recordDepthPyramid per la seconda fase che legge
+    /// anche i flag scritti dalla prima
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipelineLayout, 0, 1,
+                            &cullSets[currentImage], 0, nullptr);
+    uint32_t phaseIndex = phase;
+    vkCmdPushConstants(commandBuffer, cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(phaseIndex),
+                       &phaseIndex);
+    vkCmdDispatch(commandBuffer, (meshletCount + 63) / 64, 1, 1);
+
+    /// comandi e contatori letti dai disegni indiretti del render pass
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void GpuCulling::recordDepthPyramid(VkCommandBuffer commandBuffer) {
+    if (pyramidSets.empty()) {
+        return;
+    }
+    /// il depth buffer passa in lettura; la piramide non deve essere piu' letta dalla prima fase del culling
+    std::array<VkImageMemoryBarrier, 2> barriers{};
+    for (auto &barrier: barriers) {
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.subresourceRange.baseMipLevel = 0;
+        barrier.subresourceRange.levelCount = 1;
+        barrier.subresourceRange.baseArrayLayer = 0;
+        barrier.subresourceRange.layerCount = 1;
+    }
+    barriers[0].image = BP->depthImage;
+    barriers[0].oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    barriers[0].newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    barriers[0].subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+    barriers[0].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    barriers[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barriers[1].image = pyramidImage;
+    barriers[1].oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barriers[1].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barriers[1].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barriers[1].subresourceRange.levelCount = pyramidLevels;
+    barriers[1].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barriers[1].dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer,
+                         VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr,
+                         static_cast<uint32_t>(barriers.size()), barriers.data());
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pyramidPipeline);
+    VkImageMemoryBarrier levelBarrier = barriers[1];
+    levelBarrier.subresourceRange.levelCount = 1;
+    levelBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    levelBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    for (uint32_t level = 0; level < pyramidLevels; level++) {
+        uint32_t sizes[4] = {
+                std::max(pyramidWidth >> (level > 0 ? level - 1 : 0), 1u),
+                std::max(pyramidHeight >> (level > 0 ? level - 1 : 0), 1u),
+                std::max(pyramidWidth >> level, 1u),
+                std::max(pyramidHeight >> level, 1u)
+        };
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pyramidPipelineLayout, 0, 1,
+                                &pyramidSets[level], 0, nullptr);
+        vkCmdPushConstants(commandBuffer, pyramidPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(sizes),
+                           sizes);
+        vkCmdDispatch(commandBuffer, (sizes[2] + 7) / 8, (sizes[3] + 7) / 8, 1);
+
+        /// il livello appena scritto e' la sorgente del successivo e, alla fine, e' letto dalla seconda fase
+        levelBarrier.subresourceRange.baseMipLevel = level;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &levelBarrier);
+    }
+
+    /// il secondo render pass riscrive il depth buffer solo dopo la lettura
+    barriers[0].oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    barriers[0].newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    barriers[0].srcAccessMask = 0;
+    barriers[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                         0, 0, nullptr, 0, nullptr, 1, &barriers[0]);
+    pyramidReady = true;
+}
+
+void GpuCulling::destroy() {
+    if (descriptorPool != VK_NULL_HANDLE) {
+        vkDestroyDescriptorPool(BP->device, descriptorPool, nullptr);
+        descriptorPool = VK_NULL_HANDLE;
+    }
+    cullSets.clear();
+    pyramidSets.clear();
+    for (auto levelView: pyramidLevelViews) {
+        vkDestroyImageView(BP->device, levelView, nullptr);
+    }
+    pyramidLevelViews.clear();
+    if (pyramidImage != VK_NULL_HANDLE) {
+        vkDestroyImageView(BP->device, pyramidView, nullptr);
+        vkDestroyImage(BP->device, pyramidImage, nullptr);
+        BP->memoryAllocator.free(pyramidImageMemory);
+        pyramidImage = VK_NULL_HANDLE;
+    }
+    for (size_t i = 0; i < frameBuffers.size(); i++) {
+        BP->memoryAllocator.unmap(frameBuffersMemory[i]);
+        vkDestroyBuffer(BP->device, frameBuffers[i], nullptr);
+        BP->memoryAllocator.free(frameBuffersMemory[i]);
+    }
+    frameBuffers.clear();
+    frameBuffersMemory.clear();
+    frames.clear();
+    for (size_t i = 0; i < retestBuffers.size(); i++) {
+        vkDestroyBuffer(BP->device, retestBuffers[i], nullptr);
+        BP->memoryAllocator.free(retestBuffersMemory[i]);
+    }
+    retestBuffers.clear();
+    retestBuffersMemory.clear();
+    if (meshletBuffer != VK_NULL_HANDLE) {
+        vkDestroyBuffer(BP->device, meshletBuffer, nullptr);
+        BP->memoryAllocator.free(meshletBufferMemory);
+        meshletBuffer = VK_NULL_HANDLE;
+    }
+    meshletCount = 0;
+    pyramidReady = false;
+}
+
+void GpuCulling::cleanup() {
+    destroy();
+    if (!enabled) {
+        return;
+    }
+    vkDestroySampler(BP->device, sampler, nullptr);
+    vkDestroyPipeline(BP->device, cullPipeline, nullptr);
+    vkDestroyPipeline(BP->device, pyramidPipeline, nullptr);
+    vkDestroyPipelineLayout(BP->device, cullPipelineLayout, nullptr);
+    vkDestroyPipelineLayout(BP->device, pyramidPipelineLayout, nullptr);
+    cullSetLayout.cleanup();
+    pyramidSetLayout.cleanup();
+}
+
+/// parte del caricamento eseguibile su un thread separato prima di init(): usa un contenitore .dtex se esiste
+/// accanto ai PNG, altrimenti decodifica le sei facce della cubemap o la singola immagine
+void Texture::load(BaseProject *bp, std::vector<std::string> files, std::vector<std::vector<char>> contents) {
+    BP = bp;
+    for (const auto &bakedFile: bakedTexturePaths(files)) {
+        if (std::ifstream(bakedFile, std::ios::binary).good() && loadBaked(bakedFile)) {
+            return;
+        }
+    }
+    if (files.size() == 6) {
+        loadCubic(files, std::move(contents));
+    } else {
+        decode(files, std::move(contents));
+    }
+}
+
+/// decodifica su CPU senza chiamate Vulkan
+void Texture::decode(std::vector<std::string> files, std::vector<std::vector<char>> contents) {
+    freeDecodedPixels();
+    contents.resize(files.size());
+    for (size_t i = 0; i < files.size(); i++) {
+        const std::string &file = files[i];
+        if (contents[i].empty()) {
+            contents[i] = Pipeline::readFile(file);
+        }
+        int texWidth, texHeight, texChannels;
+        stbi_uc *pixels = stbi_load_from_memory(reinterpret_cast<const stbi_uc *>(contents[i].data()),
+                                                static_cast<int>(contents[i].size()), &texWidth, &texHeight,
+                                                &texChannels, STBI_rgb_alpha);
+        if (!pixels) {
+            std::cout << file.c_str() << "\n";
+            freeDecodedPixels();
+            throw std::runtime_error("failed to load texture image!");
+        }
+        decodedPixels.push_back(pixels);
+        decodedWidth = texWidth;
+        decodedHeight = texHeight;
+    }
+}
+
+/// decodifica le 6 facce della cubemap in parallelo, ognuna direttamente nella sua porzione dello staging buffer
+/// mappato: le dimensioni vengono lette prima dagli header PNG. Usa solo chiamate Vulkan thread-safe sul device
+void Texture::loadCubic(std::vector<std::string> files, std::vector<std::vector<char>> contents) {
+    freeDecodedPixels();
+    contents.resize(files.size());
+    for (size_t i = 0; i < files.size(); i++) {
+        if (contents[i].empty()) {
+            contents[i] = Pipeline::readFile(files[i]);
+        }
+    }
+
+    /// la dimensione della cubemap e' quella della prima faccia: alcune facce del pacchetto hanno una riga
+    /// in piu' o in meno e vengono adattate durante la copia
+    int texWidth, texHeight, texChannels;
+    if (!stbi_info_from_memory(reinterpret_cast<const stbi_uc *>(contents[0].data()),
+                               static_cast<int>(contents[0].size()), &texWidth, &texHeight, &texChannels)) {
+        std::cout << files[0].c_str() << "\n";
+        throw std::runtime_error("failed to load texture image!");
+    }
+    decodedWidth = texWidth;
+    decodedHeight = texHeight;
+
+    VkDeviceSize imageSize = texWidth * texHeight * 4;
+    VkDeviceSize totalImageSize = imageSize * files.size();
+    pendingStaging = BP->allocateStaging(totalImageSize);
+    void *data = pendingStaging.data;
+
+    std::vector<std::future<void>> faces;
+    for (size_t i = 0; i < files.size(); i++) {
+        faces.push_back(std::async(std::launch::async, [&, i]() {
+            int faceWidth, faceHeight, faceChannels;
+            stbi_uc *pixels = stbi_load_from_memory(reinterpret_cast<const stbi_uc *>(contents[i].data()),
+                                                    static_cast<int>(contents[i].size()), &faceWidth,
+                                                    &faceHeight, &faceChannels, STBI_rgb_alpha);
+            if (!pixels) {
+                std::cout << files[i].c_str() << "\n";
+                throw std::runtime_error("failed to load texture image!");
+            }
+            char *face = static_cast<char *>(data) + imageSize * i;
+            if (faceWidth == texWidth && faceHeight == texHeight) {
+                memcpy(face, pixels, static_cast<size_t>(imageSize));
+            } else {
+                /// righe e colonne mancanti ripetono l'ultima disponibile, quelle in eccesso vengono scartate
+                int copyWidth = std::min(faceWidth, texWidth);
+                for (int y = 0; y < texHeight; y++) {
+                    char *row = face + static_cast<size_t>(y) * texWidth * 4;
+                    const stbi_uc *src = pixels + static_cast<size_t>(std::min(y, faceHeight - 1)) * faceWidth * 4;
+                    memcpy(row, src, static_cast<size_t>(copyWidth) * 4);
+                    for (int x = copyWidth; x < texWidth; x++) {
+                        memcpy(row + x * 4, src + (copyWidth - 1) * 4, 4);
+                    }
+                }
+            }
+            stbi_image_free(pixels);
+        }));
+    }
+    /// si attendono tutte le facce prima di rilasciare lo staging, anche in caso di errore
+    std::exception_ptr error;
+    for (auto &face: faces) {
+        try {
+            face.get();
+        } catch (...) {
+            error = error ? error : std::current_exception();
+        }
+    }
+    if (error) {
+        freeDecodedPixels();
+        std::rethrow_exception(error);
+    }
+}
+
+void Texture::freeDecodedPixels() {
+    for (auto pixels: decodedPixels) {
+        stbi_image_free(pixels);
+    }
+    decodedPixels.clear();
+    bakedRegions.clear();
+    BP->releaseStaging(pendingStaging);
+}
+
+/// legge un contenitore .dtex (vedi BakedTexture.hpp): i livelli vengono letti dal file direttamente nello staging
+/// buffer mappato, senza decodifica ne' copie intermedie. Ritorna falso se il dispositivo non supporta il formato
+bool Texture::loadBaked(const std::string &file) {
+    freeDecodedPixels();
+
+    std::ifstream in(file, std::ios::binary);
+    BakedTextureHeader header{};
+    in.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!in || memcmp(header.magic, BAKED_TEXTURE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != BAKED_TEXTURE_VERSION || header.mipLevels == 0 ||
+        header.mipLevels > BAKED_TEXTURE_MAX_LEVELS || (header.layers != 1 && header.layers != 6)) {
+        std::cout << file.c_str() << "\n";
+        throw std::runtime_error("failed to load baked texture!");
+    }
+    if (!BP->isTextureFormatSupported(static_cast<VkFormat>(header.format))) {
+        return false;
+    }
+
+    format = static_cast<VkFormat>(header.format);
+    mipLevels = header.mipLevels;
+    bakedLayers = header.layers;
+    decodedWidth = static_cast<int>(header.width);
+    decodedHeight = static_cast<int>(header.height);
+    bakedFile = file;
+    bakedLevels.assign(header.levels, header.levels + header.mipLevels);
+
+    /// per le texture 2D si caricano subito solo i livelli piccoli, le cubemap vengono caricate intere
+    residentLevel = 0;
+    if (bakedLayers == 1) {
+        while (residentLevel + 1 < mipLevels &&
+               std::max(bakedLevels[residentLevel].width, bakedLevels[residentLevel].height) >
+               TEXTURE_STREAMING_TAIL_SIZE) {
+            residentLevel++;
+        }
+    }
+
+    const BakedTextureLevel &lastLevel = header.levels[header.mipLevels - 1];
+    VkDeviceSize dataOffset = header.levels[residentLevel].offset;
+    VkDeviceSize dataSize = lastLevel.offset + lastLevel.size - dataOffset;
+
+    bakedRegions.clear();
+    for (uint32_t level = residentLevel; level < header.mipLevels; level++) {
+        VkBufferImageCopy region{};
+        region.bufferOffset = header.levels[level].offset - dataOffset;
+        region.bufferRowLength = 0;
+        region.bufferImageHeight = 0;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = level;
+        region.imageSubresource.baseArrayLayer = 0;
+        region.imageSubresource.layerCount = bakedLayers;
+        region.imageOffset = {0, 0, 0};
+        region.imageExtent = {header.levels[level].width, header.levels[level].height, 1};
+        bakedRegions.push_back(region);
+    }
+
+    pendingStaging = BP->allocateStaging(dataSize);
+    for (auto &region: bakedRegions) {
+        region.bufferOffset += pendingStaging.offset;
+    }
+    in.seekg(static_cast<std::streamoff>(dataOffset));
+    in.read(static_cast<char *>(pendingStaging.data), static_cast<std::streamsize>(dataSize));
+    if (!in) {
+        freeDecodedPixels();
+        throw std::runtime_error("failed to load baked texture!");
+    }
+    return true;
+}
+
+/// legge un singolo livello di mip del contenitore nello staging, dal thread dello streaming
+StagingAllocation Texture::readBakedLevel(uint32_t level) {
+    const BakedTextureLevel &bakedLevel = bakedLevels[level];
+    StagingAllocation staging = BP->allocateStaging(bakedLevel.size);
+    std::ifstream in(bakedFile, std::ios::binary);
+    in.seekg(static_cast<std::streamoff>(bakedLevel.offset));
+    in.read(static_cast<char *>(staging.data), static_cast<std::streamsize>(bakedLevel.size));
+    if (!in) {
+        BP->releaseStaging(staging);
+        throw std::runtime_error("failed to load baked texture!");
+    }
+    return staging;
+}
+
+/// i livelli residenti sono gia' nello staging: una copia con una regione per livello e nessun blit.
+/// I livelli non ancora caricati passano comunque in SHADER_READ_ONLY, senza contenuto valido
+void Texture::createBakedTextureImage() {
+
+    if (bakedLayers == 6) {
+        BP->createSkyBoxImage(decodedWidth, decodedHeight, mipLevels, textureImage,
+                              textureImageMemory, format);
+    } else {
+        BP->createImage(decodedWidth, decodedHeight, mipLevels, format,
+                        VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage,
+                        textureImageMemory);
+    }
+
+    BP->uploadImage({textureImage, format, static_cast<uint32_t>(decodedWidth),
+                     static_cast<uint32_t>(decodedHeight), mipLevels, bakedLayers,
+                     pendingStaging, bakedRegions, false});
+    pendingStaging = StagingAllocation();
+    bakedRegions.clear();
+}
+
+void Texture::createCubicTextureImage(std::vector<std::string> files) {
+    /// alloco texture per ognuna delle 6 facce del cubo
+    if (pendingStaging.buffer == VK_NULL_HANDLE) {
+        loadCubic(files);
+    }
+    int texWidth = decodedWidth;
+    int texHeight = decodedHeight;
+
+    mipLevels = static_cast<uint32_t>(std::floor(
+            std::log2(std::max(texWidth, texHeight)))) + 1;
+
+    BP->createSkyBoxImage(texWidth, texHeight, mipLevels, textureImage,
+                          textureImageMemory);
 
-    vkDestroyBuffer(BP->device, stagingBuffer, nullptr);
-    vkFreeMemory(BP->device, stagingBufferMemory, nullptr);
+    BP->uploadImage({textureImage, VK_FORMAT_R8G8B8A8_SRGB, static_cast<uint32_t>(texWidth),
+                     static_cast<uint32_t>(texHeight), mipLevels, 6, pendingStaging,
+                     {imageCopyRegion(pendingStaging.offset, texWidth, texHeight, 6)}, true});
+    pendingStaging = StagingAllocation();
 }
 
 void Texture::createTextureImage(std::string file) {
-    int texWidth, texHeight, texChannels;
-    stbi_uc *pixels = stbi_load(file.c_str(), &texWidth, &texHeight,
-                                &texChannels, STBI_rgb_alpha);
-    if (!pixels) {
-        throw std::runtime_error("failed to load texture image!");
+    if (decodedPixels.empty()) {
+        decode({file});
     }
+    createTextureImage(decodedPixels[0], decodedWidth, decodedHeight);
+    freeDecodedPixels();
+}
 
+/// crea l'immagine a partire da pixel RGBA8 gia' decodificati (es. immagini incorporate in un glTF)
+void Texture::createTextureImage(const unsigned char *pixels, int texWidth, int texHeight) {
     VkDeviceSize imageSize = texWidth * texHeight * 4;
     mipLevels = static_cast<uint32_t>(std::floor(
             std::log2(std::max(texWidth, texHeight)))) + 1;
 
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-
-    BP->createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                     stagingBuffer, stagingBufferMemory);
-    void *data;
-    vkMapMemory(BP->device, stagingBufferMemory, 0, imageSize, 0, &data);
-    memcpy(data, pixels, static_cast<size_t>(imageSize));
-    vkUnmapMemory(BP->device, stagingBufferMemory);
-
-    stbi_image_free(pixels);
+    StagingAllocation staging = BP->allocateStaging(imageSize);
+    memcpy(staging.data, pixels, static_cast<size_t>(imageSize));
 
     BP->createImage(texWidth, texHeight, mipLevels, VK_FORMAT_R8G8B8A8_SRGB,
                     VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
@@ -1815,28 +4413,21 @@ void Texture::createTextureImage(std::string file) {
                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage,
                     textureImageMemory);
 
-    BP->transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
-                              VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels, 1);
-    BP->copyBufferToImage(stagingBuffer, textureImage,
-                          static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight), 1);
-
-    BP->generateMipmaps(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
-                        texWidth, texHeight, mipLevels, 1);
-
-    vkDestroyBuffer(BP->device, stagingBuffer, nullptr);
-    vkFreeMemory(BP->device, stagingBufferMemory, nullptr);
+    BP->uploadImage({textureImage, VK_FORMAT_R8G8B8A8_SRGB, static_cast<uint32_t>(texWidth),
+                     static_cast<uint32_t>(texHeight), mipLevels, 1, staging,
+                     {imageCopyRegion(staging.offset, texWidth, texHeight, 1)}, true});
 }
 
 void Texture::createTextureImageView() {
     textureImageView = BP->createImageView(textureImage,
-                                           VK_FORMAT_R8G8B8A8_SRGB,
+                                           format,
                                            VK_IMAGE_ASPECT_COLOR_BIT,
                                            mipLevels, VK_IMAGE_VIEW_TYPE_2D, 1);
 }
 
 void Texture::createSkyBoxTextureImageView() {
     textureImageView = BP->createImageView(textureImage,
-                                           VK_FORMAT_R8G8B8A8_SRGB,
+                                           format,
                                            VK_IMAGE_ASPECT_COLOR_BIT,
                                            mipLevels, VK_IMAGE_VIEW_TYPE_CUBE, 6);
 }
@@ -1869,9 +4460,30 @@ void Texture::createTextureSampler() {
 }
 
 
+/// le init non fanno nulla se la texture, condivisa tramite AssetCache, e' gia' stata caricata su GPU
 void Texture::init(BaseProject *bp, std::string file) {
+    if (textureImage != VK_NULL_HANDLE) {
+        return;
+    }
+    BP = bp;
+    if (decodedPixels.empty() && pendingStaging.buffer == VK_NULL_HANDLE) {
+        load(bp, {file});
+    }
+    if (!bakedRegions.empty()) {
+        createBakedTextureImage();
+    } else {
+        createTextureImage(file);
+    }
+    createTextureImageView();
+    createTextureSampler();
+}
+
+void Texture::initFromPixels(BaseProject *bp, const unsigned char *pixels, int width, int height) {
+    if (textureImage != VK_NULL_HANDLE) {
+        return;
+    }
     BP = bp;
-    createTextureImage(file);
+    createTextureImage(pixels, width, height);
     createTextureImageView();
     createTextureSampler();
 }
@@ -1879,8 +4491,18 @@ void Texture::init(BaseProject *bp, std::string file) {
 
 /// inizializzo skybox allocando i parametri per le 6 facce del cubo
 void Texture::initSkyBox(BaseProject *bp, std::vector<std::string> files) {
+    if (textureImage != VK_NULL_HANDLE) {
+        return;
+    }
     BP = bp;
-    createCubicTextureImage(files);
+    if (pendingStaging.buffer == VK_NULL_HANDLE) {
+        load(bp, files);
+    }
+    if (!bakedRegions.empty()) {
+        createBakedTextureImage();
+    } else {
+        createCubicTextureImage(files);
+    }
     createSkyBoxTextureImageView();
     createTextureSampler();
 }
@@ -1889,16 +4511,714 @@ void Texture::cleanup() {
     vkDestroySampler(BP->device, textureSampler, nullptr);
     vkDestroyImageView(BP->device, textureImageView, nullptr);
     vkDestroyImage(BP->device, textureImage, nullptr);
-    vkFreeMemory(BP->device, textureImageMemory, nullptr);
+    BP->memoryAllocator.free(textureImageMemory);
+}
+
+
+/// FNV-1a a 64 bit del contenuto dei file, memorizzato per percorso
+uint64_t AssetCache::hashFiles(const std::vector<std::string> &files, std::vector<std::vector<char>> *contents) {
+    uint64_t hash = 14695981039346656037ull;
+    if (contents) {
+        contents->assign(files.size(), {});
+    }
+    for (size_t i = 0; i < files.size(); i++) {
+        const std::string &file = files[i];
+        uint64_t fileHash;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto cached = fileHashes.find(file);
+            fileHash = cached != fileHashes.end() ? cached->second : 0;
+        }
+        if (fileHash == 0) {
+            std::vector<char> content = Pipeline::readFile(file);
+            fileHash = 14695981039346656037ull;
+            for (char c: content) {
+                fileHash = (fileHash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            fileHashes[file] = fileHash;
+            if (contents) {
+                (*contents)[i] = std::move(content);
+            }
+        }
+        hash = (hash ^ fileHash) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/// la parte su CPU del caricamento avviene una sola volta per contenuto, anche con richieste da piu' thread
+std::shared_ptr<Model> AssetCache::loadModel(const std::string &file) {
+    std::vector<std::vector<char>> contents;
+    uint64_t key = hashFiles({file}, &contents);
+    std::shared_ptr<Entry<Model>> entry;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &slot = models[key];
+        if (!slot) {
+            slot = std::make_shared<Entry<Model>>();
+        }
+        entry = slot;
+    }
+    std::call_once(entry->loaded, [&]() { entry->asset->load(file, std::move(contents[0])); });
+    return entry->asset;
+}
+
+/// le facce di una cubemap e i contenitori .dtex vengono letti direttamente nello staging, per questo serve il BaseProject
+std::shared_ptr<Texture> AssetCache::loadTexture(BaseProject *bp, const std::vector<std::string> &files) {
+    std::vector<std::vector<char>> contents;
+    uint64_t key = hashFiles(files, &contents);
+    std::shared_ptr<Entry<Texture>> entry;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &slot = textures[key];
+        if (!slot) {
+            slot = std::make_shared<Entry<Texture>>();
+        }
+        entry = slot;
+    }
+    std::call_once(entry->loaded, [&]() { entry->asset->load(bp, files, std::move(contents)); });
+    return entry->asset;
+}
+
+/// texture incorporata in un glTF: i pixel sono gia' nel Model, la chiave deriva da quella del file
+std::shared_ptr<Texture> AssetCache::embeddedTexture(const std::string &modelFile, int image) {
+    uint64_t key = ~hashFiles({modelFile}) + static_cast<uint64_t>(image);
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &slot = textures[key];
+    if (!slot) {
+        slot = std::make_shared<Entry<Texture>>();
+    }
+    return slot->asset;
+}
+
+/// libera le risorse referenziate solo dalla cache
+void AssetCache::collect() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = models.begin(); it != models.end();) {
+        if (it->second->asset.use_count() == 1) {
+            if (it->second->asset->vertexBuffer != VK_NULL_HANDLE) {
+                it->second->asset->cleanup();
+            }
+            it = models.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto it = textures.begin(); it != textures.end();) {
+        if (it->second->asset.use_count() == 1) {
+            if (it->second->asset->textureImage != VK_NULL_HANDLE) {
+                it->second->asset->cleanup();
+            }
+            it->second->asset->freeDecodedPixels();
+            it = textures.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+
+/// se il batch precedente e' ancora in volo lo si attende: il batch di BaseProject viene riutilizzato
+void UploadBatch::begin(BaseProject *bp) {
+    BP = bp;
+    wait();
+    images.clear();
+    buffers.clear();
+    recording = true;
+}
+
+/// senza blit lineare i mip vengono calcolati su CPU e copiati come livelli gia' pronti
+void UploadBatch::uploadImage(ImageUpload upload) {
+    if (upload.generateMipmaps && upload.mipLevels > 1 && !BP->isLinearBlitSupported(upload.format)) {
+        BP->generateMipmapsOnHost(upload);
+    }
+    images.push_back(std::move(upload));
+}
+
+void UploadBatch::uploadBuffer(BufferUpload upload) {
+    buffers.push_back(upload);
+}
+
+void UploadBatch::submit() {
+    recording = false;
+    if (images.empty() && buffers.empty()) {
+        return;
+    }
+
+    VkCommandBufferAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandPool = BP->commandPool;
+    allocInfo.commandBufferCount = 1;
+    vkAllocateCommandBuffers(BP->device, &allocInfo, &commandBuffer);
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    if (!buffers.empty()) {
+        recordBufferUploads();
+    }
+    if (!images.empty()) {
+        recordImageUploads();
+    }
+    vkEndCommandBuffer(commandBuffer);
+
+    VkFenceCreateInfo fenceInfo{};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VkResult result = vkCreateFence(BP->device, &fenceInfo, nullptr, &fence);
+    if (result != VK_SUCCESS) {
+        PrintVkError(result);
+        throw std::runtime_error("failed to create upload fence!");
+    }
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+    result = vkQueueSubmit(BP->graphicsQueue, 1, &submitInfo, fence);
+    if (result != VK_SUCCESS) {
+        PrintVkError(result);
+        throw std::runtime_error("failed to submit upload batch!");
+    }
+
+    /// le regioni del ring vengono consegnate subito al ring con il fence, i buffer dedicati restano qui
+    std::vector<StagingAllocation *> staging;
+    for (auto &image: images) {
+        staging.push_back(&image.staging);
+    }
+    for (auto &buffer: buffers) {
+        staging.push_back(&buffer.staging);
+    }
+    for (auto allocation: staging) {
+        if (allocation->memory.block == nullptr) {
+            BP->releaseStaging(*allocation, fence);
+        } else {
+            stagingInFlight.push_back(*allocation);
+        }
+    }
+    images.clear();
+    buffers.clear();
+}
+
+bool UploadBatch::isComplete() {
+    if (fence == VK_NULL_HANDLE) {
+        return true;
+    }
+    if (vkGetFenceStatus(BP->device, fence) != VK_SUCCESS) {
+        return false;
+    }
+    retire();
+    return true;
+}
+
+void UploadBatch::wait() {
+    if (fence == VK_NULL_HANDLE) {
+        return;
+    }
+    vkWaitForFences(BP->device, 1, &fence, VK_TRUE, UINT64_MAX);
+    retire();
+}
+
+void UploadBatch::retire() {
+    for (auto &staging: stagingInFlight) {
+        BP->releaseStaging(staging);
+    }
+    stagingInFlight.clear();
+    BP->retireStagingFence(fence);
+    vkDestroyFence(BP->device, fence, nullptr);
+    vkFreeCommandBuffers(BP->device, BP->commandPool, 1, &commandBuffer);
+    fence = VK_NULL_HANDLE;
+    commandBuffer = VK_NULL_HANDLE;
+}
+
+/// una copia per buffer e una sola barriera che rende i dati visibili al vertex input dei frame successivi
+void UploadBatch::recordBufferUploads() {
+    std::vector<VkBufferMemoryBarrier> barriers;
+    for (const auto &upload: buffers) {
+        VkBufferCopy copyRegion{};
+        copyRegion.srcOffset = upload.staging.offset;
+        copyRegion.dstOffset = 0;
+        copyRegion.size = upload.size;
+        vkCmdCopyBuffer(commandBuffer, upload.staging.buffer, upload.buffer, 1, &copyRegion);
+
+        VkBufferMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.buffer = upload.buffer;
+        barrier.offset = 0;
+        barrier.size = VK_WHOLE_SIZE;
+        barriers.push_back(barrier);
+    }
+    vkCmdPipelineBarrier(commandBuffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0,
+                         0, nullptr,
+                         static_cast<uint32_t>(barriers.size()), barriers.data(),
+                         0, nullptr);
+}
+
+void UploadBatch::recordImageUploads() {
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseArrayLayer = 0;
+
+    /// tutte le immagini, tutti i livelli: UNDEFINED -> TRANSFER_DST
+    /// i livelli gia' campionati (streaming) devono aspettare i frame precedenti che li leggono
+    std::vector<VkImageMemoryBarrier> barriers;
+    VkPipelineStageFlags sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    uint32_t maxGeneratedLevels = 0;
+    for (const auto &image: images) {
+        barrier.image = image.image;
+        barrier.subresourceRange.baseMipLevel = image.baseMipLevel;
+        barrier.subresourceRange.levelCount = image.mipLevels - image.baseMipLevel;
+        barrier.subresourceRange.layerCount = image.layerCount;
+        barrier.oldLayout = image.oldLayout;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barriers.push_back(barrier);
+        if (image.oldLayout != VK_IMAGE_LAYOUT_UNDEFINED) {
+            sourceStage |= VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        }
+        if (image.generateMipmaps) {
+            maxGeneratedLevels = std::max(maxGeneratedLevels, image.mipLevels);
+        }
+    }
+    vkCmdPipelineBarrier(commandBuffer,
+                         sourceStage,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                         0, nullptr, 0, nullptr,
+                         static_cast<uint32_t>(barriers.size()), barriers.data());
+
+    for (const auto &image: images) {
+        vkCmdCopyBufferToImage(commandBuffer, image.staging.buffer, image.image,
+                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                               static_cast<uint32_t>(image.regions.size()), image.regions.data());
+    }
+
+    /// mip generati un livello alla volta per tutte le immagini insieme: il livello i-1 passa a TRANSFER_SRC
+    /// e viene ridotto nel livello i, con tutte le facce in un solo blit
+    for (uint32_t level = 1; level < maxGeneratedLevels; level++) {
+        barriers.clear();
+        for (const auto &image: images) {
+            if (!image.generateMipmaps || level >= image.mipLevels) {
+                continue;
+            }
+            barrier.image = image.image;
+            barrier.subresourceRange.baseMipLevel = level - 1;
+            barrier.subresourceRange.levelCount = 1;
+            barrier.subresourceRange.layerCount = image.layerCount;
+            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+            barriers.push_back(barrier);
+        }
+        vkCmdPipelineBarrier(commandBuffer,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                             0, nullptr, 0, nullptr,
+                             static_cast<uint32_t>(barriers.size()), barriers.data());
+
+        for (const auto &image: images) {
+            if (!image.generateMipmaps || level >= image.mipLevels) {
+                continue;
+            }
+            int32_t srcWidth = std::max(static_cast<int32_t>(image.width >> (level - 1)), 1);
+            int32_t srcHeight = std::max(static_cast<int32_t>(image.height >> (level - 1)), 1);
+
+            VkImageBlit blit{};
+            blit.srcOffsets[0] = {0, 0, 0};
+            blit.srcOffsets[1] = {srcWidth, srcHeight, 1};
+            blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            blit.srcSubresource.mipLevel = level - 1;
+            blit.srcSubresource.baseArrayLayer = 0;
+            blit.srcSubresource.layerCount = image.layerCount;
+            blit.dstOffsets[0] = {0, 0, 0};
+            blit.dstOffsets[1] = {srcWidth > 1 ? srcWidth / 2 : 1,
+                                  srcHeight > 1 ? srcHeight / 2 : 1, 1};
+            blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            blit.dstSubresource.mipLevel = level;
+            blit.dstSubresource.baseArrayLayer = 0;
+            blit.dstSubresource.layerCount = image.layerCount;
+
+            vkCmdBlitImage(commandBuffer, image.image,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
+                           &blit, VK_FILTER_LINEAR);
+        }
+    }
+
+    /// tutto verso SHADER_READ_ONLY: i livelli letti dai blit sono in TRANSFER_SRC, l'ultimo (o tutti, per le
+    /// immagini con i mip gia' pronti) in TRANSFER_DST
+    barriers.clear();
+    for (const auto &image: images) {
+        barrier.image = image.image;
+        barrier.subresourceRange.layerCount = image.layerCount;
+        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        uint32_t sourceLevels = image.generateMipmaps ? image.mipLevels - 1 : image.baseMipLevel;
+        if (image.generateMipmaps && sourceLevels > 0) {
+            barrier.subresourceRange.baseMipLevel = 0;
+            barrier.subresourceRange.levelCount = sourceLevels;
+            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+            barriers.push_back(barrier);
+        }
+        barrier.subresourceRange.baseMipLevel = sourceLevels;
+        barrier.subresourceRange.levelCount = image.mipLevels - sourceLevels;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barriers.push_back(barrier);
+    }
+    vkCmdPipelineBarrier(commandBuffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+                         0, nullptr, 0, nullptr,
+                         static_cast<uint32_t>(barriers.size()), barriers.data());
+}
+
+
+void TextureStreamer::init(BaseProject *bp) {
+    BP = bp;
+    stopping = false;
+    worker = std::thread(&TextureStreamer::run, this);
+}
+
+/// livello desiderato in base alla distanza; si chiede solo il livello successivo a quelli residenti
+void TextureStreamer::request(Texture *texture, float distance) {
+    if (texture == nullptr || texture->bakedLevels.empty() || texture->residentLevel == 0 ||
+        texture->streamingLevel || texture->streamingFailed) {
+        return;
+    }
+    uint32_t desiredLevel = 0;
+    if (distance > TEXTURE_STREAMING_FULL_DETAIL_DISTANCE) {
+        desiredLevel = static_cast<uint32_t>(std::log2(distance / TEXTURE_STREAMING_FULL_DETAIL_DISTANCE)) + 1;
+    }
+    if (texture->residentLevel <= desiredLevel) {
+        return;
+    }
+    /// le texture condivise (es. le eliche) tengono la richiesta dell'istanza piu' vicina
+    for (auto &frameRequest: frameRequests) {
+        if (frameRequest.texture == texture) {
+            frameRequest.distance = std::min(frameRequest.distance, distance);
+            return;
+        }
+    }
+    frameRequests.push_back({texture, texture->residentLevel - 1, distance});
+}
+
+/// chiamata dal thread principale a ogni frame: invia in un batch i livelli letti e passa le nuove richieste
+/// al thread di caricamento finche' non si raggiunge TEXTURE_STREAMING_UPLOAD_CAP
+void TextureStreamer::update() {
+    std::vector<Request> failedRequests;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        failedRequests.swap(failed);
+    }
+    for (auto &request: failedRequests) {
+        request.texture->streamingLevel = false;
+        request.texture->streamingFailed = true;
+        inFlightBytes -= request.texture->bakedLevels[request.level].size;
+    }
+
+    if (batch.isComplete()) {
+        std::vector<std::pair<Request, StagingAllocation>> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.swap(loaded);
+        }
+        if (!ready.empty()) {
+            batch.begin(BP);
+            for (auto &item: ready) {
+                Texture *texture = item.first.texture;
+                uint32_t level = item.first.level;
+                VkBufferImageCopy region = imageCopyRegion(item.second.offset, texture->bakedLevels[level].width,
+                                                           texture->bakedLevels[level].height, 1);
+                region.imageSubresource.mipLevel = level;
+                batch.uploadImage({texture->textureImage, texture->format, texture->bakedLevels[level].width,
+                                   texture->bakedLevels[level].height, level + 1, 1, item.second, {region},
+                                   false, level, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL});
+            }
+            batch.submit();
+            /// i frame inviati dopo il batch vedono i nuovi livelli, grazie alla barriera finale
+            for (auto &item: ready) {
+                item.first.texture->residentLevel = item.first.level;
+                item.first.texture->streamingLevel = false;
+                VkDeviceSize size = item.first.texture->bakedLevels[item.first.level].size;
+                inFlightBytes -= size;
+                uploadedBytes += size;
+            }
+        }
+    }
+
+    std::sort(frameRequests.begin(), frameRequests.end(), [](const Request &a, const Request &b) {
+        return a.distance < b.distance;
+    });
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &frameRequest: frameRequests) {
+            VkDeviceSize size = frameRequest.texture->bakedLevels[frameRequest.level].size;
+            if (uploadedBytes + inFlightBytes + size > TEXTURE_STREAMING_UPLOAD_CAP) {
+                continue;
+            }
+            frameRequest.texture->streamingLevel = true;
+            inFlightBytes += size;
+            pending.push_back(frameRequest);
+        }
+        std::stable_sort(pending.begin(), pending.end(), [](const Request &a, const Request &b) {
+            return a.distance < b.distance;
+        });
+    }
+    if (!frameRequests.empty()) {
+        wakeUp.notify_one();
+    }
+    frameRequests.clear();
+}
+
+void TextureStreamer::run() {
+    while (true) {
+        Request next{};
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeUp.wait(lock, [this]() { return stopping || !pending.empty(); });
+            if (stopping) {
+                return;
+            }
+            next = pending.front();
+            pending.pop_front();
+        }
+        /// se la lettura fallisce la texture resta ai livelli gia' caricati
+        StagingAllocation staging;
+        try {
+            staging = next.texture->readBakedLevel(next.level);
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            std::lock_guard<std::mutex> lock(mutex);
+            failed.push_back(next);
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        loaded.emplace_back(next, staging);
+    }
+}
+
+void TextureStreamer::cleanup() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeUp.notify_one();
+    if (worker.joinable()) {
+        worker.join();
+    }
+    batch.wait();
+    for (auto &request: pending) {
+        request.texture->streamingLevel = false;
+    }
+    pending.clear();
+    for (auto &item: loaded) {
+        item.first.texture->streamingLevel = false;
+        BP->releaseStaging(item.second);
+    }
+    loaded.clear();
+    for (auto &request: failed) {
+        request.texture->streamingLevel = false;
+    }
+    failed.clear();
+    frameRequests.clear();
+    inFlightBytes = 0;
+}
+
+
+void CommandRecorder::init(BaseProject *bp, unsigned threads) {
+    BP = bp;
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    threadCount = threads;
+    stopping = false;
+    generation = 0;
+    if (threadCount == 1) {
+        return;
+    }
+
+    QueueFamilyIndices queueFamilyIndices = BP->findQueueFamilies(BP->physicalDevice);
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+    commandPools.resize(MAX_FRAMES_IN_FLIGHT * threadCount);
+    commandBuffers.resize(MAX_FRAMES_IN_FLIGHT * threadCount);
+    for (size_t i = 0; i < commandPools.size(); i++) {
+        VkResult result = vkCreateCommandPool(BP->device, &poolInfo, nullptr, &commandPools[i]);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create command pool!");
+        }
+
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = commandPools[i];
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        allocInfo.commandBufferCount = 1;
+
+        result = vkAllocateCommandBuffers(BP->device, &allocInfo, &commandBuffers[i]);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to allocate command buffers!");
+        }
+    }
+
+    for (uint32_t part = 1; part < threadCount; part++) {
+        workers.emplace_back(&CommandRecorder::run, this, part);
+    }
+}
+
+uint32_t CommandRecorder::partCount(uint32_t draws) const {
+    uint32_t needed = (draws + MIN_DRAWS_PER_RECORDING_PART - 1) / MIN_DRAWS_PER_RECORDING_PART;
+    return std::max(std::min(threadCount, needed), 1u);
+}
+
+void CommandRecorder::record(VkCommandBuffer primary, uint32_t currentFrame, uint32_t currentImage,
+                             uint32_t partsToRecord) {
+    /// il fence del frame e' segnalato: i pool usati del frame si possono azzerare prima di far partire i worker
+    for (uint32_t part = 0; part < partsToRecord; part++) {
+        vkResetCommandPool(BP->device, commandPools[currentFrame * threadCount + part], 0);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        frame = currentFrame;
+        imageIndex = currentImage;
+        parts = partsToRecord;
+        running = partsToRecord - 1;
+        failed = false;
+        error = nullptr;
+        generation++;
+    }
+    wakeUp.notify_all();
+
+    /// anche se la parte 0 fallisce si aspettano i worker, che usano i pool e lo stato del frame
+    bool recorded = false;
+    std::exception_ptr mainError;
+    try {
+        recorded = recordPart(0);
+    } catch (...) {
+        mainError = std::current_exception();
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this]() { return running == 0; });
+        recorded = recorded && !failed;
+        if (!mainError) {
+            mainError = error;
+        }
+    }
+    if (mainError) {
+        std::rethrow_exception(mainError);
+    }
+    if (!recorded) {
+        throw std::runtime_error("failed to record secondary command buffer!");
+    }
+
+    vkCmdExecuteCommands(primary, partsToRecord, &commandBuffers[currentFrame * threadCount]);
+}
+
+/// gli stati non vengono ereditati dal primary: la parte eredita solo render pass, subpass e framebuffer
+bool CommandRecorder::recordPart(uint32_t part) {
+    VkCommandBuffer commandBuffer = commandBuffers[frame * threadCount + part];
+
+    VkCommandBufferInheritanceInfo inheritanceInfo{};
+    inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritanceInfo.renderPass = BP->renderPass;
+    inheritanceInfo.subpass = 0;
+    inheritanceInfo.framebuffer = BP->swapChainFramebuffers[imageIndex];
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+                      VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        return false;
+    }
+    BP->populateCommandBufferPart(commandBuffer, static_cast<int>(imageIndex), part, parts, CULL_PHASE_EARLY);
+    return vkEndCommandBuffer(commandBuffer) == VK_SUCCESS;
+}
+
+void CommandRecorder::run(uint32_t part) {
+    uint64_t recordedGeneration = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeUp.wait(lock, [this, recordedGeneration]() {
+                return stopping || generation != recordedGeneration;
+            });
+            if (stopping) {
+                return;
+            }
+            recordedGeneration = generation;
+            /// parte non usata in questo frame
+            if (part >= parts) {
+                continue;
+            }
+        }
+        /// un'eccezione non deve terminare il programma dal worker: la rilancia record()
+        bool recorded = false;
+        std::exception_ptr partError;
+        try {
+            recorded = recordPart(part);
+        } catch (...) {
+            partError = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            failed = failed || !recorded;
+            if (partError && !error) {
+                error = partError;
+            }
+            running--;
+        }
+        finished.notify_one();
+    }
+}
+
+void CommandRecorder::cleanup() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for (auto &worker: workers) {
+        worker.join();
+    }
+    workers.clear();
+    /// distruggere i pool libera anche i command buffer secondari
+    for (auto commandPool: commandPools) {
+        vkDestroyCommandPool(BP->device, commandPool, nullptr);
+    }
+    commandPools.clear();
+    commandBuffers.clear();
 }
 
 
 void Pipeline::init(BaseProject *bp, const std::string &VertShader, const std::string &FragShader,
-                    std::vector<DescriptorSetLayout *> D, bool first, bool isSkyBox) {
+                    std::vector<DescriptorSetLayout *> D, bool first, bool isSkyBox,
+                    VertexFormat format, uint32_t pushConstantsSize, PipelineDepthMode depthMode) {
     BP = bp;
+    vertexFormat = format;
+    bool hasFragmentShader = depthMode != DEPTH_PREPASS;
 
     auto vertShaderCode = readFile(VertShader);
-    auto fragShaderCode = readFile(FragShader);
+    auto fragShaderCode = hasFragmentShader ? readFile(FragShader) : std::vector<char>();
     if (first) {
         std::cout << "Vertex shader len: " <<
                   vertShaderCode.size() << "\n";
@@ -1909,8 +5229,8 @@ void Pipeline::init(BaseProject *bp, const std::string &VertShader, const std::s
 
     VkShaderModule vertShaderModule =
             createShaderModule(vertShaderCode);
-    VkShaderModule fragShaderModule =
-            createShaderModule(fragShaderCode);
+    VkShaderModule fragShaderModule = hasFragmentShader ?
+            createShaderModule(fragShaderCode) : VK_NULL_HANDLE;
 
     VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
     vertShaderStageInfo.sType =
@@ -1919,6 +5239,16 @@ void Pipeline::init(BaseProject *bp, const std::string &VertShader, const std::s
     vertShaderStageInfo.module = vertShaderModule;
     vertShaderStageInfo.pName = "main";
 
+    /// constant_id 0 dice al vertex shader se deve decodificare i vertici compressi
+    VkBool32 packedVertices = vertexFormat == VERTEX_PACKED ? VK_TRUE : VK_FALSE;
+    VkSpecializationMapEntry specializationEntry{0, 0, sizeof(VkBool32)};
+    VkSpecializationInfo specializationInfo{};
+    specializationInfo.mapEntryCount = 1;
+    specializationInfo.pMapEntries = &specializationEntry;
+    specializationInfo.dataSize = sizeof(VkBool32);
+    specializationInfo.pData = &packedVertices;
+    vertShaderStageInfo.pSpecializationInfo = &specializationInfo;
+
     VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
     fragShaderStageInfo.sType =
             VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -1933,13 +5263,37 @@ void Pipeline::init(BaseProject *bp, const std::string &VertShader, const std::s
     VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
     vertexInputInfo.sType =
             VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    auto bindingDescription = Vertex::getBindingDescription();
-    auto attributeDescriptions = Vertex::getAttributeDescriptions();
+    std::vector<VkVertexInputBindingDescription> bindingDescriptions;
+    std::vector<VkVertexInputAttributeDescription> attributeDescriptions;
+    if (vertexFormat == VERTEX_STREAMS) {
+        /// un binding per attributo: posizione, normale e coordinate texture in buffer separati
+        const VkFormat streamFormats[] = {VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32B32_SFLOAT,
+                                          VK_FORMAT_R32G32_SFLOAT};
+        const uint32_t streamStrides[] = {sizeof(glm::vec3), sizeof(glm::vec3), sizeof(glm::vec2)};
+        for (uint32_t i = 0; i < 3; i++) {
+            bindingDescriptions.push_back({i, streamStrides[i], VK_VERTEX_INPUT_RATE_VERTEX});
+            attributeDescriptions.push_back({i, i, streamFormats[i], 0});
+        }
+    } else if (vertexFormat == VERTEX_PACKED) {
+        auto attributes = PackedVertex::getAttributeDescriptions();
+        bindingDescriptions.push_back(PackedVertex::getBindingDescription());
+        attributeDescriptions.assign(attributes.begin(), attributes.end());
+    } else {
+        auto attributes = Vertex::getAttributeDescriptions();
+        bindingDescriptions.push_back(Vertex::getBindingDescription());
+        attributeDescriptions.assign(attributes.begin(), attributes.end());
+    }
+    /// il pre-pass legge solo la posizione (location 0), con lo stesso stride dei vertici completi
+    if (depthMode == DEPTH_PREPASS) {
+        attributeDescriptions.resize(1);
+        bindingDescriptions.resize(1);
+    }
 
-    vertexInputInfo.vertexBindingDescriptionCount = 1;
+    vertexInputInfo.vertexBindingDescriptionCount =
+            static_cast<uint32_t>(bindingDescriptions.size());
     vertexInputInfo.vertexAttributeDescriptionCount =
             static_cast<uint32_t>(attributeDescriptions.size());
-    vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+    vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions.data();
     vertexInputInfo.pVertexAttributeDescriptions =
             attributeDescriptions.data();
 
@@ -2000,7 +5354,7 @@ void Pipeline::init(BaseProject *bp, const std::string &VertShader, const std::s
     multisampling.alphaToOneEnable = VK_FALSE; // Optional
 
     VkPipelineColorBlendAttachmentState colorBlendAttachment{};
-    colorBlendAttachment.colorWriteMask =
+    colorBlendAttachment.colorWriteMask = depthMode == DEPTH_PREPASS ? 0 :
             VK_COLOR_COMPONENT_R_BIT |
             VK_COLOR_COMPONENT_G_BIT |
             VK_COLOR_COMPONENT_B_BIT |
@@ -2042,8 +5396,12 @@ void Pipeline::init(BaseProject *bp, const std::string &VertShader, const std::s
             VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     pipelineLayoutInfo.setLayoutCount = DSL.size();
     pipelineLayoutInfo.pSetLayouts = DSL.data();
-    pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-    pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = pushConstantsSize;
+    pipelineLayoutInfo.pushConstantRangeCount = pushConstantsSize > 0 ? 1 : 0;
+    pipelineLayoutInfo.pPushConstantRanges = pushConstantsSize > 0 ? &pushConstantRange : nullptr;
 
     VkResult result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr,
                                              &pipelineLayout);
@@ -2057,8 +5415,8 @@ void Pipeline::init(BaseProject *bp, const std::string &VertShader, const std::s
     depthStencil.sType =
             VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
     depthStencil.depthTestEnable = VK_TRUE;
-    depthStencil.depthWriteEnable = VK_TRUE;
-    depthStencil.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+    depthStencil.depthWriteEnable = depthMode == DEPTH_EQUAL ? VK_FALSE : VK_TRUE;
+    depthStencil.depthCompareOp = depthMode == DEPTH_EQUAL ? VK_COMPARE_OP_EQUAL : VK_COMPARE_OP_LESS_OR_EQUAL;
     depthStencil.depthBoundsTestEnable = VK_FALSE;
     depthStencil.minDepthBounds = 0.0f; // Optional
     depthStencil.maxDepthBounds = 1.0f; // Optional
@@ -2069,7 +5427,7 @@ void Pipeline::init(BaseProject *bp, const std::string &VertShader, const std::s
     VkGraphicsPipelineCreateInfo pipelineInfo{};
     pipelineInfo.sType =
             VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipelineInfo.stageCount = 2;
+    pipelineInfo.stageCount = hasFragmentShader ? 2 : 1;
     pipelineInfo.pStages = shaderStages;
     pipelineInfo.pVertexInputState = &vertexInputInfo;
     pipelineInfo.pInputAssemblyState = &inputAssembly;
@@ -2092,7 +5450,9 @@ void Pipeline::init(BaseProject *bp, const std::string &VertShader, const std::s
         throw std::runtime_error("failed to create graphics pipeline!");
     }
 
-    vkDestroyShaderModule(BP->device, fragShaderModule, nullptr);
+    if (hasFragmentShader) {
+        vkDestroyShaderModule(BP->device, fragShaderModule, nullptr);
+    }
     vkDestroyShaderModule(BP->device, vertShaderModule, nullptr);
 }
 
@@ -2146,7 +5506,7 @@ void DescriptorSetLayout::init(BaseProject *bp, std::vector<DescriptorSetLayoutB
     for (int i = 0; i < B.size(); i++) {
         bindings[i].binding = B[i].binding;
         bindings[i].descriptorType = B[i].type;
-        bindings[i].descriptorCount = 1;
+        bindings[i].descriptorCount = B[i].count;
         bindings[i].stageFlags = B[i].flags;
         bindings[i].pImmutableSamplers = nullptr;
     }
@@ -2175,18 +5535,28 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
     // Create uniform buffer
     uniformBuffers.resize(E.size());
     uniformBuffersMemory.resize(E.size());
+    uniformBuffersMapped.resize(E.size());
     toFree.resize(E.size());
 
     for (int j = 0; j < E.size(); j++) {
         uniformBuffers[j].resize(BP->swapChainImages.size());
         uniformBuffersMemory[j].resize(BP->swapChainImages.size());
-        if (E[j].type == UNIFORM) {
+        uniformBuffersMapped[j].resize(BP->swapChainImages.size(), nullptr);
+        if (E[j].type == UNIFORM || E[j].type == UNIFORM_DYNAMIC) {
+            VkDeviceSize bufferSize = E[j].size;
+            if (E[j].type == UNIFORM_DYNAMIC) {
+                VkDeviceSize alignment = BP->minUniformBufferOffsetAlignment;
+                dynamicStride = (bufferSize + alignment - 1) / alignment * alignment;
+                dynamicCount = E[j].count;
+                dynamicUsed = 0;
+                bufferSize = dynamicStride * dynamicCount;
+            }
             for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-                VkDeviceSize bufferSize = E[j].size;
                 BP->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
                                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                                  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
                                  uniformBuffers[j][i], uniformBuffersMemory[j][i]);
+                uniformBuffersMapped[j][i] = BP->memoryAllocator.map(uniformBuffersMemory[j][i]);
             }
             toFree[j] = true;
         } else {
@@ -2214,8 +5584,10 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 
     for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
         std::vector<VkWriteDescriptorSet> descriptorWrites(E.size());
+        std::vector<std::vector<VkDescriptorImageInfo>> imageArrays(E.size());
         for (int j = 0; j < E.size(); j++) {
-            if (E[j].type == UNIFORM) {
+            if (E[j].type == UNIFORM || E[j].type == UNIFORM_DYNAMIC) {
+                /// con UNIFORM_DYNAMIC il descrittore copre un blocco, l'offset arriva da vkCmdBindDescriptorSets
                 VkDescriptorBufferInfo bufferInfo{};
                 bufferInfo.buffer = uniformBuffers[j][i];
                 bufferInfo.offset = 0;
@@ -2225,7 +5597,9 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
                 descriptorWrites[j].dstSet = descriptorSets[i];
                 descriptorWrites[j].dstBinding = E[j].binding;
                 descriptorWrites[j].dstArrayElement = 0;
-                descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+                descriptorWrites[j].descriptorType = E[j].type == UNIFORM_DYNAMIC ?
+                                                     VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC :
+                                                     VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
                 descriptorWrites[j].descriptorCount = 1;
                 descriptorWrites[j].pBufferInfo = &bufferInfo;
             } else if (E[j].type == TEXTURE) {
@@ -2242,6 +5616,23 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
                 descriptorWrites[j].descriptorCount = 1;
                 descriptorWrites[j].pImageInfo = &imageInfo;
+            } else if (E[j].type == TEXTURE_ARRAY) {
+                for (Texture *texture: E[j].textures) {
+                    VkDescriptorImageInfo imageInfo{};
+                    imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                    imageInfo.imageView = texture->textureImageView;
+                    imageInfo.sampler = texture->textureSampler;
+                    imageArrays[j].push_back(imageInfo);
+                }
+
+                descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                descriptorWrites[j].dstSet = descriptorSets[i];
+                descriptorWrites[j].dstBinding = E[j].binding;
+                descriptorWrites[j].dstArrayElement = 0;
+                descriptorWrites[j].descriptorType =
+                        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+                descriptorWrites[j].descriptorCount = static_cast<uint32_t>(imageArrays[j].size());
+                descriptorWrites[j].pImageInfo = imageArrays[j].data();
             }
         }
         vkUpdateDescriptorSets(BP->device,
@@ -2251,12 +5642,21 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 
 }
 
+/// offset del prossimo blocco libero del buffer dinamico, da passare come offset dinamico al bind del set
+uint32_t DescriptorSet::allocateDynamicOffset() {
+    if (dynamicUsed == dynamicCount) {
+        throw std::runtime_error("too many objects for the dynamic uniform buffer!");
+    }
+    return static_cast<uint32_t>(dynamicStride * dynamicUsed++);
+}
+
 void DescriptorSet::cleanup() {
     for (int j = 0; j < uniformBuffers.size(); j++) {
         if (toFree[j]) {
             for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
+                BP->memoryAllocator.unmap(uniformBuffersMemory[j][i]);
                 vkDestroyBuffer(BP->device, uniformBuffers[j][i], nullptr);
-                vkFreeMemory(BP->device, uniformBuffersMemory[j][i], nullptr);
+                BP->memoryAllocator.free(uniformBuffersMemory[j][i]);
             }
         }
     }
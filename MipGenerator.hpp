@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MIP_GENERATOR_SSE2
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MIP_GENERATOR_AVX2
+#endif
+
+/// Generazione dei livelli di mip su CPU per immagini RGBA8, usata da TextureBaker e dal caricamento delle texture
+/// quando il formato non supporta il blit lineare. Il filtro e' un box 2x2: ogni texel di destinazione e' la media
+/// dei 2x2 texel che copre. Con un lato dispari l'ultima colonna (riga) di destinazione media invece 3 texel con
+/// peso 1/3, cosi' nessun texel viene scartato; un lato di 1 texel viene ripetuto. Per i dati sRGB la media dei
+/// colori e' fatta in spazio lineare, l'alpha e' sempre lineare. I valori lineari sono interi a 14 bit: la somma dei
+/// 4 texel sta in 16 bit e viene calcolata con SSE2 (8 canali) o AVX2 (16 canali) alla volta, le conversioni passano
+/// da tabelle.
+/// Il risultato coincide con il blit lineare di vkCmdBlitImage (a meno dell'arrotondamento) solo dove i lati sono
+/// pari. Su un lato dispari il blit interpola bilinearmente nel punto che corrisponde al centro del texel di
+/// destinazione: pesa i texel in modo non uniforme e ne ignora alcuni, quindi i due percorsi producono livelli
+/// diversi. MIPMAP_BENCHMARK usa un'immagine 1024x1024, dove i due filtri coincidono.
+
+const int MIP_LINEAR_BITS = 14;
+const int MIP_LINEAR_MAX = (1 << MIP_LINEAR_BITS) - 1;
+/// sotto questo numero di pixel di destinazione per thread non conviene dividere il livello
+const uint64_t MIP_PIXELS_PER_THREAD = 16 * 1024;
+
+struct MipTables {
+    /// sRGB 8 bit -> lineare 14 bit
+    uint16_t srgbToLinear[256];
+    /// canali gia' lineari: stessa scala a 14 bit
+    uint16_t unormToLinear[256];
+    /// lineare 14 bit -> sRGB 8 bit
+    unsigned char linearToSrgb[MIP_LINEAR_MAX + 1];
+};
+
+inline const MipTables &mipTables() {
+    static const MipTables tables = [] {
+        MipTables t{};
+        for (int i = 0; i < 256; i++) {
+            float v = i / 255.0f;
+            float linear = v <= 0.04045f ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+            t.srgbToLinear[i] = static_cast<uint16_t>(linear * MIP_LINEAR_MAX + 0.5f);
+            t.unormToLinear[i] = static_cast<uint16_t>(i << (MIP_LINEAR_BITS - 8));
+        }
+        for (int i = 0; i <= MIP_LINEAR_MAX; i++) {
+            float v = static_cast<float>(i) / MIP_LINEAR_MAX;
+            float s = v <= 0.0031308f ? v * 12.92f : 1.055f * std::pow(v, 1.0f / 2.4f) - 0.055f;
+            t.linearToSrgb[i] = static_cast<unsigned char>(std::min(std::max(s, 0.0f), 1.0f) * 255.0f + 0.5f);
+        }
+        return t;
+    }();
+    return tables;
+}
+
+/// converte una riga in valori lineari, max(srcWidth, 2 * dstWidth) pixel: se la riga e' larga 1 il pixel si ripete
+inline void mipExpandRow(const unsigned char *src, uint32_t srcWidth, uint32_t dstWidth, bool srgb, uint16_t *out) {
+    const MipTables &tables = mipTables();
+    const uint16_t *color = srgb ? tables.srgbToLinear : tables.unormToLinear;
+    for (uint32_t x = 0; x < std::max(srcWidth, 2 * dstWidth); x++) {
+        const unsigned char *p = src + static_cast<size_t>(std::min(x, srcWidth - 1)) * 4;
+        out[x * 4 + 0] = color[p[0]];
+        out[x * 4 + 1] = color[p[1]];
+        out[x * 4 + 2] = color[p[2]];
+        out[x * 4 + 3] = tables.unormToLinear[p[3]];
+    }
+}
+
+/// somma dei quattro texel di ogni pixel di destinazione, canale per canale
+inline void mipSumQuads(const uint16_t *row0, const uint16_t *row1, uint32_t dstWidth, bool simd, uint16_t *sums) {
+    uint32_t x = 0;
+    if (simd) {
+#ifdef MIP_GENERATOR_AVX2
+        /// 4 pixel per iterazione; unpack lavora nelle due meta' del registro, il permute rimette in ordine i pixel
+        for (; x + 4 <= dstWidth; x += 4) {
+            __m256i a = _mm256_add_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(row0 + x * 8)),
+                                         _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row1 + x * 8)));
+            __m256i b = _mm256_add_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(row0 + x * 8 + 16)),
+                                         _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row1 + x * 8 + 16)));
+            __m256i s = _mm256_add_epi16(_mm256_unpacklo_epi64(a, b), _mm256_unpackhi_epi64(a, b));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(sums + x * 4), _mm256_permute4x64_epi64(s, 0xD8));
+        }
+#endif
+#ifdef MIP_GENERATOR_SSE2
+        /// 2 pixel per iterazione: ogni registro contiene due texel RGBA adiacenti
+        for (; x + 2 <= dstWidth; x += 2) {
+            __m128i a = _mm_add_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + x * 8)),
+                                      _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + x * 8)));
+            __m128i b = _mm_add_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + x * 8 + 8)),
+                                      _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + x * 8 + 8)));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(sums + x * 4),
+                             _mm_add_epi16(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b)));
+        }
+#endif
+    }
+    for (; x < dstWidth; x++) {
+        for (uint32_t c = 0; c < 4; c++) {
+            sums[x * 4 + c] = static_cast<uint16_t>(row0[x * 8 + c] + row0[x * 8 + 4 + c] +
+                                                    row1[x * 8 + c] + row1[x * 8 + 4 + c]);
+        }
+    }
+}
+
+/// righe [begin, end) della destinazione, contate su tutte le facce
+inline void mipDownsampleRows(const unsigned char *src, uint32_t srcWidth, uint32_t srcHeight, unsigned char *dst,
+                              bool srgb, bool simd, uint32_t begin, uint32_t end) {
+    const MipTables &tables = mipTables();
+    uint32_t dstWidth = std::max(srcWidth / 2, 1u);
+    uint32_t dstHeight = std::max(srcHeight / 2, 1u);
+    size_t srcFace = static_cast<size_t>(srcWidth) * srcHeight * 4;
+    size_t dstFace = static_cast<size_t>(dstWidth) * dstHeight * 4;
+
+    /// lati dispari maggiori di 1: la terza colonna (riga) dell'ultimo pixel di destinazione
+    bool oddWidth = srcWidth > 1 && srcWidth % 2 == 1;
+    bool oddHeight = srcHeight > 1 && srcHeight % 2 == 1;
+    size_t expandedWidth = std::max(srcWidth, 2 * dstWidth);
+
+    std::vector<uint16_t> row0(expandedWidth * 4);
+    std::vector<uint16_t> row1(expandedWidth * 4);
+    std::vector<uint16_t> row2(expandedWidth * 4);
+    std::vector<uint16_t> sums(static_cast<size_t>(dstWidth) * 4);
+    for (uint32_t row = begin; row < end; row++) {
+        uint32_t face = row / dstHeight;
+        uint32_t y = row % dstHeight;
+        bool lastRow = oddHeight && y == dstHeight - 1;
+        const unsigned char *srcFacePixels = src + srcFace * face;
+        mipExpandRow(srcFacePixels + static_cast<size_t>(std::min(2 * y, srcHeight - 1)) * srcWidth * 4,
+                     srcWidth, dstWidth, srgb, row0.data());
+        mipExpandRow(srcFacePixels + static_cast<size_t>(std::min(2 * y + 1, srcHeight - 1)) * srcWidth * 4,
+                     srcWidth, dstWidth, srgb, row1.data());
+        if (lastRow) {
+            mipExpandRow(srcFacePixels + static_cast<size_t>(2 * y + 2) * srcWidth * 4,
+                         srcWidth, dstWidth, srgb, row2.data());
+        }
+        mipSumQuads(row0.data(), row1.data(), dstWidth, simd, sums.data());
+
+        unsigned char *out = dst + dstFace * face + static_cast<size_t>(y) * dstWidth * 4;
+        for (uint32_t i = 0; i < dstWidth * 4; i++) {
+            bool color = srgb && i % 4 != 3;
+            uint32_t x = i / 4;
+            if (lastRow || (oddWidth && x == dstWidth - 1)) {
+                /// media di 2x3, 3x2 o 3x3 texel, fuori dalla somma a 16 bit
+                uint32_t columns = oddWidth && x == dstWidth - 1 ? 3 : 2;
+                uint32_t sum = 0;
+                for (uint32_t column = 0; column < columns; column++) {
+                    size_t texel = (2 * x + column) * 4 + i % 4;
+                    sum += row0[texel] + row1[texel] + (lastRow ? row2[texel] : 0);
+                }
+                uint32_t count = columns * (lastRow ? 3 : 2);
+                uint32_t linear = (sum + count / 2) / count;
+                out[i] = color ? tables.linearToSrgb[linear]
+                               : static_cast<unsigned char>((linear + (1 << (MIP_LINEAR_BITS - 9))) >>
+                                                            (MIP_LINEAR_BITS - 8));
+                continue;
+            }
+            /// (somma + 2) / 4 sui valori lineari, poi ritorno a 8 bit
+            out[i] = color ? tables.linearToSrgb[(sums[i] + 2) >> 2]
+                           : static_cast<unsigned char>((sums[i] + (1 << (MIP_LINEAR_BITS - 7))) >> (MIP_LINEAR_BITS - 6));
+        }
+    }
+}
+
+/// dimezza un livello di `layers` facce consecutive (lo stesso layout del buffer di copia per vkCmdCopyBufferToImage).
+/// Le righe di tutte le facce vengono divise fra i thread; threads == 0 usa tutti i core disponibili
+inline void mipDownsample(const unsigned char *src, uint32_t srcWidth, uint32_t srcHeight, unsigned char *dst,
+                          uint32_t layers, bool srgb, unsigned threads = 0, bool simd = true) {
+    uint32_t dstWidth = std::max(srcWidth / 2, 1u);
+    uint32_t rows = std::max(srcHeight / 2, 1u) * layers;
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    uint64_t work = static_cast<uint64_t>(dstWidth) * rows / MIP_PIXELS_PER_THREAD;
+    threads = static_cast<unsigned>(std::min<uint64_t>({threads, rows, std::max<uint64_t>(work, 1)}));
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; i++) {
+        workers.emplace_back(mipDownsampleRows, src, srcWidth, srcHeight, dst, srgb, simd,
+                             rows * i / threads, rows * (i + 1) / threads);
+    }
+    mipDownsampleRows(src, srcWidth, srcHeight, dst, srgb, simd, 0, rows / threads);
+    for (auto &worker: workers) {
+        worker.join();
+    }
+}
+
+/// dimensione in byte di un livello RGBA8 con tutte le sue facce
+inline uint64_t mipLevelSize(uint32_t width, uint32_t height, uint32_t level, uint32_t layers) {
+    return static_cast<uint64_t>(std::max(width >> level, 1u)) * std::max(height >> level, 1u) * 4 * layers;
+}
+
+/// riempie i livelli 1..mipLevels-1 a partire dal livello 0; offsets[level] e' l'inizio del livello in data
+inline void generateMipChain(unsigned char *data, const std::vector<uint64_t> &offsets, uint32_t width,
+                             uint32_t height, uint32_t mipLevels, uint32_t layers, bool srgb,
+                             unsigned threads = 0, bool simd = true) {
+    for (uint32_t level = 1; level < mipLevels; level++) {
+        mipDownsample(data + offsets[level - 1], std::max(width >> (level - 1), 1u),
+                      std::max(height >> (level - 1), 1u), data + offsets[level], layers, srgb, threads, simd);
+    }
+}
@@ -7,8 +7,18 @@ struct GlobalUniformBufferObject {
     alignas(16) glm::mat4 proj;
 };
 
+/// dati costanti della mesh, scritti una volta all'init nel blocco dell'oggetto
 struct UniformBufferObject {
+    alignas(16) glm::vec4 posOffset;
+    alignas(16) glm::vec4 posScale;
+};
+
+/// dati che cambiano ad ogni frame, passati con vkCmdPushConstants (80 byte, sotto i 128 garantiti)
+struct ObjectPushConstants {
     alignas(16) glm::mat4 model;
+    /// x: primo livello di mip residente della texture, sotto il quale lo shader non campiona;
+    /// y: indice della texture nell'array condiviso dagli oggetti
+    alignas(16) glm::vec4 textureInfo;
 };
 
 struct SkyBoxUniformBufferObject {
@@ -20,28 +30,86 @@ struct SkyBoxUniformBufferObject {
 
 class BaseModel {
 public:
-    Model model;
-    Texture texture{};
+    /// mesh e texture possono essere condivise con altri BaseModel tramite l'AssetCache del BaseProject
+    std::shared_ptr<Model> model;
+    std::shared_ptr<Texture> texture;
+    /// glTF disegnati con VERTEX_STREAMS: texture del materiale di ogni primitiva (texture se non ne ha una).
+    /// Negli altri formati le primitive sono unite in un'unica mesh e usano tutte texture
+    std::vector<std::shared_ptr<Texture>> subMeshTextures;
+    std::vector<uint32_t> subMeshTextureIndices;
+    MeshletDrawList meshletDrawList;
+    /// set con il proprio uniform buffer, solo per lo skybox
     DescriptorSet descriptorSet;
 
     BaseProject *baseProjectPtr;
-    DescriptorSetLayout *descriptorSetLayoutPtr;
+    DescriptorSetLayout *descriptorSetLayoutPtr = nullptr;
     Pipeline *pipeline;
 
+    /// gli altri oggetti hanno un blocco nel uniform buffer dinamico condiviso, selezionato con uniformOffset
+    DescriptorSet *objectDescriptorSetPtr = nullptr;
+    uint32_t uniformOffset = 0;
+
+    /// ultima worldMatrix passata a setWorldMatrix(), usata dal culling dei meshlet
+    glm::mat4 worldMatrix = glm::mat4(1.0f);
+    /// posizione della texture nell'array di texture degli oggetti (set 2)
+    uint32_t textureIndex = 0;
+
     BaseModel(BaseProject *baseProjectPtr, DescriptorSetLayout *descriptorSetLayoutPtr, Pipeline *pipeline) {
         this->baseProjectPtr = baseProjectPtr;
         this->descriptorSetLayoutPtr = descriptorSetLayoutPtr;
         this->pipeline = pipeline;
     }
 
+    BaseModel(BaseProject *baseProjectPtr, DescriptorSet *objectDescriptorSetPtr, Pipeline *pipeline) {
+        this->baseProjectPtr = baseProjectPtr;
+        this->objectDescriptorSetPtr = objectDescriptorSetPtr;
+        this->pipeline = pipeline;
+    }
+
+    /// parte su CPU di init(): legge la mesh e decodifica le texture senza chiamate Vulkan,
+    /// per questo puo' essere eseguita su un thread separato
+    void load(const std::string &modelPath, const std::vector<std::string> &texturePath, bool isSkyBox = false) {
+        AssetCache &assetCache = baseProjectPtr->assetCache;
+        model = assetCache.loadModel(modelPath);
+        if (isSkyBox) {
+            texture = assetCache.loadTexture(baseProjectPtr, texturePath);
+        } else if (texturePath.empty() && model->baseColorImage >= 0) {
+            texture = assetCache.embeddedTexture(modelPath, model->baseColorImage);
+        } else {
+            texture = assetCache.loadTexture(baseProjectPtr, {texturePath[0]});
+        }
+    }
+
     void init(std::string modelPath, std::vector<std::string> texturePath, bool first, bool isSkyBox = false) {
         if (first) {
-            model.init(baseProjectPtr, std::move(modelPath));
+            if (!model) {
+                load(modelPath, texturePath, isSkyBox);
+            }
+            model->init(baseProjectPtr, modelPath, (*pipeline).vertexFormat);
             if (isSkyBox) {
                 /// different initialization for cubemap
-                texture.initSkyBox(baseProjectPtr, texturePath);
+                texture->initSkyBox(baseProjectPtr, texturePath);
+            } else if (texturePath.empty() && model->baseColorImage >= 0) {
+                /// texture incorporata nel file glTF, gia' decodificata dal loader
+                const tinygltf::Image &image = model->images[model->baseColorImage];
+                texture->initFromPixels(baseProjectPtr, image.image.data(), image.width, image.height);
+                /// le texture condivise tra primitive vengono caricate una volta sola
+                subMeshTextures.clear();
+                if (model->vertexFormat == VERTEX_STREAMS) {
+                    for (const auto &subMesh: model->subMeshes) {
+                        if (subMesh.image < 0) {
+                            subMeshTextures.push_back(texture);
+                            continue;
+                        }
+                        const tinygltf::Image &subMeshImage = model->images[subMesh.image];
+                        subMeshTextures.push_back(baseProjectPtr->assetCache.embeddedTexture(modelPath,
+                                                                                             subMesh.image));
+                        subMeshTextures.back()->initFromPixels(baseProjectPtr, subMeshImage.image.data(),
+                                                               subMeshImage.width, subMeshImage.height);
+                    }
+                }
             } else {
-                texture.init(baseProjectPtr, texturePath[0]);
+                texture->init(baseProjectPtr, texturePath[0]);
             }
             //texture.init(baseProjectPtr, std::move(texturePath));
         }
@@ -49,56 +117,137 @@ public:
         if (isSkyBox)
             descriptorSet.init(baseProjectPtr, descriptorSetLayoutPtr, {
                     {0, UNIFORM, sizeof(SkyBoxUniformBufferObject), nullptr},
-                    {1, TEXTURE, 0,                                 &texture}
-            });
-        else
-            descriptorSet.init(baseProjectPtr, descriptorSetLayoutPtr, {
-                    {0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-                    {1, TEXTURE, 0,                           &texture}
+                    {1, TEXTURE, 0,                                 texture.get()}
             });
+        else {
+            /// la texture arriva dall'array condiviso e il uniform buffer e' un blocco di quello dinamico
+            uniformOffset = objectDescriptorSetPtr->allocateDynamicOffset();
+            UniformBufferObject ubo{model->posOffset, model->posScale};
+            for (void *mapped: objectDescriptorSetPtr->uniformBuffersMapped[0]) {
+                memcpy(static_cast<char *>(mapped) + uniformOffset, &ubo, sizeof(ubo));
+            }
+            meshletDrawList.init(baseProjectPtr, model.get());
+        }
 
     }
 
-    void populateCommandBuffer(VkCommandBuffer *commandBuffer, int currentImage, int firstDescriptorSet) {
-        VkBuffer vertexBuffers[] = {model.vertexBuffer};
+    /// vertex e index buffer della mesh (le mesh glTF legano i propri per ogni primitiva)
+    void bindBuffers(VkCommandBuffer *commandBuffer) {
+        if (model->vertexFormat == VERTEX_STREAMS) {
+            return;
+        }
+        VkBuffer vertexBuffers[] = {model->vertexBuffer};
         VkDeviceSize offsets[] = {0};
         vkCmdBindVertexBuffers(*commandBuffer, 0, 1, vertexBuffers, offsets);
-        vkCmdBindIndexBuffer(*commandBuffer, model.indexBuffer, 0,
-                             VK_INDEX_TYPE_UINT32);
-        vkCmdBindDescriptorSets(*commandBuffer,
-                                VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                (*pipeline).pipelineLayout, firstDescriptorSet, 1,
-                                &descriptorSet.descriptorSets[currentImage],
-                                0, nullptr);
-        vkCmdDrawIndexed(*commandBuffer,
-                         static_cast<uint32_t>(model.indices.size()), 1, 0, 0, 0);
+        vkCmdBindIndexBuffer(*commandBuffer, model->indexBuffer, 0,
+                             model->indexType);
     }
 
-    void draw(uint32_t currentImage, UniformBufferObject *uboPtr, void *dataPtr, VkDevice *devicePtr,
-              glm::mat4 worldMatrix) {
-        (*uboPtr).model = worldMatrix;
-        vkMapMemory(*devicePtr, descriptorSet.uniformBuffersMemory[0][currentImage], 0,
-                    sizeof(*uboPtr), 0, &dataPtr);
-        memcpy(dataPtr, uboPtr, sizeof(*uboPtr));
-        vkUnmapMemory(*devicePtr, descriptorSet.uniformBuffersMemory[0][currentImage]);
+    /// buffersBound: il disegno precedente nello stesso command buffer usa lo stesso Model e ha gia' legato i buffer.
+    /// phase: render pass del culling su GPU di cui disegnare i meshlet
+    void populateCommandBuffer(VkCommandBuffer *commandBuffer, int currentImage, int firstDescriptorSet,
+                               bool buffersBound = false, CullPhase phase = CULL_PHASE_EARLY) {
+        if (objectDescriptorSetPtr != nullptr) {
+            vkCmdBindDescriptorSets(*commandBuffer,
+                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    (*pipeline).pipelineLayout, firstDescriptorSet, 1,
+                                    &objectDescriptorSetPtr->descriptorSets[currentImage],
+                                    1, &uniformOffset);
+            ObjectPushConstants pushConstants{};
+            pushConstants.model = worldMatrix;
+            pushConstants.textureInfo = glm::vec4(static_cast<float>(texture->residentLevel),
+                                                  static_cast<float>(textureIndex), 0.0f, 0.0f);
+            vkCmdPushConstants(*commandBuffer, (*pipeline).pipelineLayout,
+                               VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0,
+                               sizeof(pushConstants), &pushConstants);
+        } else {
+            vkCmdBindDescriptorSets(*commandBuffer,
+                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    (*pipeline).pipelineLayout, firstDescriptorSet, 1,
+                                    &descriptorSet.descriptorSets[currentImage],
+                                    0, nullptr);
+        }
+
+        /// glTF: ogni primitiva ha i suoi attributi e indici dentro lo stesso buffer
+        if (model->vertexFormat == VERTEX_STREAMS) {
+            for (size_t i = 0; i < model->subMeshes.size(); i++) {
+                const SubMesh &subMesh = model->subMeshes[i];
+                if (objectDescriptorSetPtr != nullptr && i < subMeshTextures.size()) {
+                    glm::vec4 textureInfo(static_cast<float>(subMeshTextures[i]->residentLevel),
+                                          static_cast<float>(subMeshTextureIndices[i]), 0.0f, 0.0f);
+                    vkCmdPushConstants(*commandBuffer, (*pipeline).pipelineLayout,
+                                       VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+                                       offsetof(ObjectPushConstants, textureInfo), sizeof(textureInfo),
+                                       &textureInfo);
+                }
+                VkBuffer streams[] = {model->vertexBuffer, model->vertexBuffer, model->vertexBuffer};
+                VkDeviceSize streamOffsets[] = {subMesh.posOffset, subMesh.normOffset, subMesh.uvOffset};
+                vkCmdBindVertexBuffers(*commandBuffer, 0, 3, streams, streamOffsets);
+                vkCmdBindIndexBuffer(*commandBuffer, model->vertexBuffer, subMesh.indexOffset,
+                                     subMesh.indexType);
+                vkCmdDrawIndexed(*commandBuffer, subMesh.indexCount, 1, 0, 0, 0);
+            }
+            return;
+        }
+
+        if (!buffersBound) {
+            bindBuffers(commandBuffer);
+        }
+        if (meshletDrawList.commandCount > 0) {
+            meshletDrawList.draw(*commandBuffer, currentImage, phase);
+        } else {
+            vkCmdDrawIndexed(*commandBuffer,
+                             static_cast<uint32_t>(model->indices.size()), 1, 0, 0, 0);
+        }
+    }
+
+    /// bounding sphere del modello in coordinate mondo (centro in xyz, raggio in w), con la worldMatrix dell'ultimo draw
+    glm::vec4 worldBoundingSphere() const {
+        glm::vec3 center = glm::vec3(worldMatrix * glm::vec4(model->boundsCenter, 1.0f));
+        float scale = std::max(glm::length(glm::vec3(worldMatrix[0])),
+                               std::max(glm::length(glm::vec3(worldMatrix[1])),
+                                        glm::length(glm::vec3(worldMatrix[2]))));
+        return glm::vec4(center, model->boundsRadius * scale);
+    }
+
+    void cullMeshlets(uint32_t currentImage, const glm::mat4 &viewProj, glm::vec3 cameraPosition) {
+        meshletDrawList.cull(currentImage, worldMatrix, viewProj, cameraPosition);
     }
 
-    void draw(uint32_t currentImage, SkyBoxUniformBufferObject *suboPtr, void *dataPtr, VkDevice *devicePtr,
-              glm::mat4 worldMatrix) {
+    /// la priorita' dello streaming e' la distanza tra la camera e il box del modello in coordinate mondo
+    void streamTexture(glm::vec3 cameraPosition) {
+        glm::vec3 worldMin(std::numeric_limits<float>::max());
+        glm::vec3 worldMax(-std::numeric_limits<float>::max());
+        for (int corner = 0; corner < 8; corner++) {
+            glm::vec3 local((corner & 1) ? model->boundsMax.x : model->boundsMin.x,
+                            (corner & 2) ? model->boundsMax.y : model->boundsMin.y,
+                            (corner & 4) ? model->boundsMax.z : model->boundsMin.z);
+            glm::vec3 world = glm::vec3(worldMatrix * glm::vec4(local, 1.0f));
+            worldMin = glm::min(worldMin, world);
+            worldMax = glm::max(worldMax, world);
+        }
+        glm::vec3 closest = glm::clamp(cameraPosition, worldMin, worldMax);
+        baseProjectPtr->textureStreamer.request(texture.get(), glm::length(cameraPosition - closest));
+    }
+
+    /// la matrice arriva allo shader come push constant quando il command buffer del frame viene registrato
+    void setWorldMatrix(const glm::mat4 &worldMatrix) {
+        this->worldMatrix = worldMatrix;
+    }
+
+    void draw(uint32_t currentImage, SkyBoxUniformBufferObject *suboPtr, glm::mat4 worldMatrix) {
         (*suboPtr).model = worldMatrix;
-        vkMapMemory(*devicePtr, descriptorSet.uniformBuffersMemory[0][currentImage], 0,
-                    sizeof(*suboPtr), 0, &dataPtr);
-        memcpy(dataPtr, suboPtr, sizeof(*suboPtr));
-        vkUnmapMemory(*devicePtr, descriptorSet.uniformBuffersMemory[0][currentImage]);
+        memcpy(descriptorSet.uniformBuffersMapped[0][currentImage], suboPtr, sizeof(*suboPtr));
     }
 
 
+    /// le risorse GPU di mesh e texture vengono liberate dall'AssetCache quando nessun BaseModel le usa piu'
     void cleanUp(bool definitive) {
+        meshletDrawList.cleanup();
         if (definitive) {
-            model.cleanup();
-            if (descriptorSet.uniformBuffers.size() > 1) {
-                texture.cleanup();
-            }
+            model.reset();
+            texture.reset();
+            subMeshTextures.clear();
         }
         descriptorSet.cleanup();
 
@@ -127,11 +276,11 @@ public:
     float scale_factor = 5.f;
     glm::mat4 worldMatrix = glm::mat4(1.f);
 
-    Terrain(BaseProject *baseProjectPtr, DescriptorSetLayout *descriptorSetLayoutPtr,
-            Pipeline *pipeline) : terrainBaseModel(baseProjectPtr, descriptorSetLayoutPtr, pipeline) {};
+    Terrain(BaseProject *baseProjectPtr, DescriptorSet *objectDescriptorSetPtr,
+            Pipeline *pipeline) : terrainBaseModel(baseProjectPtr, objectDescriptorSetPtr, pipeline) {};
 
 
-    void draw(uint32_t currentImage, UniformBufferObject *uboPtr, void *dataPtr, VkDevice *devicePtr) {
+    void draw() {
         glm::mat4 translation = glm::translate(glm::mat4(1), position);
         glm::mat4 rotation = glm::rotate(glm::mat4(1.0f),
                                          glm::radians(-90.0f),
@@ -139,12 +288,12 @@ public:
         glm::mat4 scaling = glm::scale(glm::mat4(1.0f), glm::vec3(scale_factor));
 
         worldMatrix = translation * rotation * scaling;
-        terrainBaseModel.draw(currentImage, uboPtr, dataPtr, devicePtr, worldMatrix);
+        terrainBaseModel.setWorldMatrix(worldMatrix);
     }
 
 
     glm::vec3 getVertex(float x, float z) {
-        auto terrainVertices = terrainBaseModel.model.vertices;
+        auto terrainVertices = terrainBaseModel.model->vertices;
         // seleziono il limite superiore della finestra di ricerca
         // se è la prima volta seleziono l'intero set dei vertici altrimenti seleziono il minore
         // tra la lunghezza dell'array di vertici e lastVertex + grandezza della finestra
@@ -308,7 +457,7 @@ private:
     bool canStep(DroneDirections droneDirection) {
         glm::mat4 dwm = computeDroneWorldMatrix();
         // trasformo il vertice di riferimento del drone con la worldMatrix del drone
-        glm::vec3 droneVertexWorldPos = getWorldPosition(droneBaseModel.model.vertices[315].pos, dwm);
+        glm::vec3 droneVertexWorldPos = getWorldPosition(droneBaseModel.model->vertices[315].pos, dwm);
 
         // restituisce il vertice del terreno più vicino a quello di riferimento per il drone già trasformato
         // con la worldMatrix del terreno
@@ -333,23 +482,24 @@ public:
 
     glm::mat4 droneWorldMatrix = glm::mat4(1.f);
 
-    Drone(BaseProject *baseProjectPtr, DescriptorSetLayout *descriptorSetLayoutPtr,
-          Pipeline *pipeline, glm::vec3 *cameraPosition, Terrain *terrain) : droneBaseModel(baseProjectPtr,
-                                                                                            descriptorSetLayoutPtr,
+    Drone(BaseProject *baseProjectPtr, DescriptorSet *objectDescriptorSetPtr,
+          Pipeline *pipeline, Pipeline *fanPipeline, glm::vec3 *cameraPosition,
+          Terrain *terrain) : droneBaseModel(baseProjectPtr,
+                                                                                            objectDescriptorSetPtr,
                                                                                             pipeline),
                                                                              fanBaseModelList{
                                                                                      BaseModel(baseProjectPtr,
-                                                                                               descriptorSetLayoutPtr,
-                                                                                               pipeline),
+                                                                                               objectDescriptorSetPtr,
+                                                                                               fanPipeline),
                                                                                      BaseModel(baseProjectPtr,
-                                                                                               descriptorSetLayoutPtr,
-                                                                                               pipeline),
+                                                                                               objectDescriptorSetPtr,
+                                                                                               fanPipeline),
                                                                                      BaseModel(baseProjectPtr,
-                                                                                               descriptorSetLayoutPtr,
-                                                                                               pipeline),
+                                                                                               objectDescriptorSetPtr,
+                                                                                               fanPipeline),
                                                                                      BaseModel(baseProjectPtr,
-                                                                                               descriptorSetLayoutPtr,
-                                                                                               pipeline)} {
+                                                                                               objectDescriptorSetPtr,
+                                                                                               fanPipeline)} {
         this->terrain = terrain;
         this->cameraPosition = cameraPosition;
         *(this->cameraPosition) = position;
@@ -370,9 +520,8 @@ public:
         return droneTranslation * droneRotation * droneScaling;
     }
 
-    /// calcola le worldMatrix del drone e delle eliche e le passa al metodo draw() del BaseModel per settare i valori
-    /// degli uniform buffer
-    void draw(uint32_t currentImage, UniformBufferObject *uboPtr, void *dataPtr, VkDevice *devicePtr) {
+    /// calcola le worldMatrix del drone e delle eliche e le assegna ai rispettivi BaseModel
+    void draw() {
 
         glm::mat4 droneTranslation = glm::translate(glm::mat4(1), position);
         glm::mat4 droneRotation = glm::mat4(glm::quat(glm::vec3(0, direction.y, 0)) *
@@ -380,7 +529,7 @@ public:
                                             glm::quat(glm::vec3(0, 0, direction.z)));
         glm::mat4 droneScaling = glm::scale(glm::mat4(1.0f), glm::vec3(SCALE_FACTOR));
         droneWorldMatrix = computeDroneWorldMatrix();
-        droneBaseModel.draw(currentImage, uboPtr, dataPtr, devicePtr, droneWorldMatrix);
+        droneBaseModel.setWorldMatrix(droneWorldMatrix);
 
 
         //Drawing fans
@@ -399,19 +548,19 @@ public:
         // ogni elica viene traslata dal centro del drone alla specifica posizione negli angoli
         glm::mat4 positioningWRTDrone = glm::translate(glm::mat4(1.0f), glm::vec3(0.54f, 0.26f, -0.4f));
         glm::mat4 fanWorldMatrix = movesAndInclination * positioningWRTDrone * scalingAndRotation;
-        fanBaseModelList[0].draw(currentImage, uboPtr, dataPtr, devicePtr, fanWorldMatrix);
+        fanBaseModelList[0].setWorldMatrix(fanWorldMatrix);
 
         positioningWRTDrone = glm::translate(glm::mat4(1.0f), glm::vec3(-0.54f, 0.26f, -0.4f));
         fanWorldMatrix = movesAndInclination * positioningWRTDrone * scalingAndRotation;
-        fanBaseModelList[1].draw(currentImage, uboPtr, dataPtr, devicePtr, fanWorldMatrix);
+        fanBaseModelList[1].setWorldMatrix(fanWorldMatrix);
 
         positioningWRTDrone = glm::translate(glm::mat4(1.0f), glm::vec3(-0.54f, 0.11f, 0.4f));
         fanWorldMatrix = movesAndInclination * positioningWRTDrone * scalingAndRotation;
-        fanBaseModelList[2].draw(currentImage, uboPtr, dataPtr, devicePtr, fanWorldMatrix);
+        fanBaseModelList[2].setWorldMatrix(fanWorldMatrix);
 
         positioningWRTDrone = glm::translate(glm::mat4(1.0f), glm::vec3(0.54f, 0.11f, 0.4f));
         fanWorldMatrix = movesAndInclination * positioningWRTDrone * scalingAndRotation;
-        fanBaseModelList[3].draw(currentImage, uboPtr, dataPtr, devicePtr, fanWorldMatrix);
+        fanBaseModelList[3].setWorldMatrix(fanWorldMatrix);
     }
 
     /// metodo usato per muovere il drone specificando la direzione di movimento.
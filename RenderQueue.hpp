@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/// coda dei disegni del frame: ogni disegno ha una chiave a 64 bit e l'indice dell'oggetto da disegnare. Le chiavi
+/// sono ordinate con un radix sort LSD a byte (8 passate da 256 contatori, saltate quando tutte le chiavi hanno lo
+/// stesso byte) e chi registra i comandi lega pipeline e buffer solo quando cambiano rispetto al disegno precedente.
+/// Campi della chiave, dal piu' significativo:
+///   63..56  pipeline (ordine scelto dall'applicazione, per esempio lo skybox per ultimo)
+///   55..32  stato condiviso tra oggetti dello stesso materiale (per esempio la mesh con i suoi buffer)
+///   31..0   profondita': i bit di un float non negativo hanno lo stesso ordine del valore, quindi gli oggetti
+///           opachi vengono disegnati dal piu' vicino al piu' lontano e il depth test scarta prima i frammenti
+///           nascosti
+
+const uint32_t RENDER_QUEUE_PIPELINE_BITS = 8;
+const uint32_t RENDER_QUEUE_MATERIAL_BITS = 24;
+
+struct RenderQueueItem {
+    uint64_t key;
+    uint32_t index;
+};
+
+inline uint64_t renderQueueKey(uint32_t pipeline, uint32_t material, float depth) {
+    uint32_t depthBits;
+    /// non std::max: lascerebbe passare -0.0f (bit di segno = chiave massima) e NaN, che qui diventano 0
+    depth = depth > 0.0f ? depth : 0.0f;
+    std::memcpy(&depthBits, &depth, sizeof(depthBits));
+    uint64_t pipelineField = pipeline & ((1u << RENDER_QUEUE_PIPELINE_BITS) - 1);
+    uint64_t materialField = material & ((1u << RENDER_QUEUE_MATERIAL_BITS) - 1);
+    return pipelineField << (64 - RENDER_QUEUE_PIPELINE_BITS) | materialField << 32 | depthBits;
+}
+
+struct RenderQueue {
+    std::vector<RenderQueueItem> items;
+    /// buffer delle passate del radix sort, riusato tra i frame come items
+    std::vector<RenderQueueItem> scratch;
+    /// stati gia' visti da materialId, nell'ordine in cui sono comparsi
+    std::vector<const void *> materials;
+
+    void clear() {
+        items.clear();
+    }
+
+    void push(uint64_t key, uint32_t index) {
+        items.push_back({key, index});
+    }
+
+    /// identificativo compatto di uno stato condiviso (per esempio un Model), stabile tra i frame
+    uint32_t materialId(const void *material) {
+        auto found = std::find(materials.begin(), materials.end(), material);
+        if (found != materials.end()) {
+            return static_cast<uint32_t>(found - materials.begin());
+        }
+        materials.push_back(material);
+        return static_cast<uint32_t>(materials.size() - 1);
+    }
+
+    /// ordinamento stabile per chiave crescente
+    void sort() {
+        size_t count = items.size();
+        if (count < 2) {
+            return;
+        }
+        scratch.resize(count);
+        for (uint32_t shift = 0; shift < 64; shift += 8) {
+            size_t offsets[256] = {};
+            for (const auto &item: items) {
+                offsets[(item.key >> shift) & 0xFF]++;
+            }
+            /// tutte le chiavi hanno lo stesso byte: la passata non cambierebbe l'ordine
+            if (offsets[(items[0].key >> shift) & 0xFF] == count) {
+                continue;
+            }
+            size_t sum = 0;
+            for (auto &offset: offsets) {
+                size_t bucket = offset;
+                offset = sum;
+                sum += bucket;
+            }
+            for (const auto &item: items) {
+                scratch[offsets[(item.key >> shift) & 0xFF]++] = item;
+            }
+            items.swap(scratch);
+        }
+    }
+};
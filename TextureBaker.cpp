@@ -0,0 +1,462 @@
+// Offline texture baker: converte uno o sei PNG (cubemap) in un contenitore .dtex con tutti i livelli di mip
+// gia' calcolati, vedi BakedTexture.hpp. Con -f i livelli vengono compressi a blocchi (BC1, BC3, BC7);
+// "bc" sceglie BC1 per le immagini opache e BC3 per quelle con trasparenza.
+//
+// Uso: TextureBaker [-f rgba8|bc|bc1|bc3|bc7] <output.dtex> <input.png> [<-x.png> <+y.png> <-y.png> <+z.png> <-z.png>]
+//      TextureBaker -b <input.png>    misura la velocita' del generatore di mip su CPU
+
+#define STB_IMAGE_IMPLEMENTATION
+
+#include <stb_image.h>
+
+#include "BakedTexture.hpp"
+#include "MipGenerator.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+struct Image {
+    int width;
+    int height;
+    std::vector<unsigned char> pixels;
+};
+
+/// livello successivo della catena, con il generatore condiviso con il caricamento delle texture (MipGenerator.hpp)
+static Image downsample(const Image &src) {
+    Image dst;
+    dst.width = std::max(src.width / 2, 1);
+    dst.height = std::max(src.height / 2, 1);
+    dst.pixels.resize(static_cast<size_t>(dst.width) * dst.height * 4);
+    mipDownsample(src.pixels.data(), src.width, src.height, dst.pixels.data(), 1, true);
+    return dst;
+}
+
+/// MB/s (byte dei livelli sorgente letti) della catena completa, con e senza SIMD, su un thread e su tutti i core
+static void benchmark(const Image &image) {
+    uint32_t width = image.width;
+    uint32_t height = image.height;
+    uint32_t mipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(width, height)))) + 1;
+    std::vector<uint64_t> offsets(mipLevels);
+    uint64_t size = 0;
+    uint64_t sourceBytes = 0;
+    for (uint32_t level = 0; level < mipLevels; level++) {
+        offsets[level] = size;
+        size += mipLevelSize(width, height, level, 1);
+        sourceBytes += level + 1 < mipLevels ? mipLevelSize(width, height, level, 1) : 0;
+    }
+    std::vector<unsigned char> chain(size);
+    memcpy(chain.data(), image.pixels.data(), image.pixels.size());
+
+    std::cout << width << "x" << height << ", " << mipLevels << " levels" << std::endl;
+    for (bool simd: {false, true}) {
+        for (unsigned threads: {1u, 0u}) {
+            /// almeno mezzo secondo di misura
+            int iterations = 0;
+            auto start = std::chrono::high_resolution_clock::now();
+            double seconds = 0.0;
+            do {
+                generateMipChain(chain.data(), offsets, width, height, mipLevels, 1, true, threads, simd);
+                iterations++;
+                seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+            } while (seconds < 0.5);
+            std::cout << (simd ? "simd  " : "scalar") << " " << (threads == 1 ? "1 thread  " : "all cores ")
+                      << sourceBytes * iterations / seconds / (1024.0 * 1024.0) << " MB/s" << std::endl;
+        }
+    }
+}
+
+/// 16 pixel RGBA di un blocco 4x4; ai bordi delle immagini (o dei mip piu' piccoli di 4x4) si ripete l'ultimo pixel
+static void readBlock(const Image &image, int bx, int by, unsigned char block[16][4]) {
+    for (int y = 0; y < 4; y++) {
+        for (int x = 0; x < 4; x++) {
+            int sx = std::min(bx * 4 + x, image.width - 1);
+            int sy = std::min(by * 4 + y, image.height - 1);
+            memcpy(block[y * 4 + x], &image.pixels[(static_cast<size_t>(sy) * image.width + sx) * 4], 4);
+        }
+    }
+}
+
+/// estremi del blocco lungo l'asse principale dei colori (iterazione di potenza sulla covarianza)
+static void principalEndpoints(const unsigned char block[16][4], int channels, float minColor[4], float maxColor[4]) {
+    float mean[4] = {0, 0, 0, 0};
+    for (int i = 0; i < 16; i++) {
+        for (int c = 0; c < channels; c++) {
+            mean[c] += block[i][c] / 16.0f;
+        }
+    }
+    float cov[4][4] = {};
+    for (int i = 0; i < 16; i++) {
+        for (int a = 0; a < channels; a++) {
+            for (int b = 0; b < channels; b++) {
+                cov[a][b] += (block[i][a] - mean[a]) * (block[i][b] - mean[b]);
+            }
+        }
+    }
+    float axis[4] = {1, 1, 1, 1};
+    for (int iteration = 0; iteration < 8; iteration++) {
+        float next[4] = {0, 0, 0, 0};
+        float length = 0;
+        for (int a = 0; a < channels; a++) {
+            for (int b = 0; b < channels; b++) {
+                next[a] += cov[a][b] * axis[b];
+            }
+            length = std::max(length, std::abs(next[a]));
+        }
+        if (length == 0) {
+            break;
+        }
+        for (int a = 0; a < channels; a++) {
+            axis[a] = next[a] / length;
+        }
+    }
+    float minT = 0, maxT = 0;
+    for (int i = 0; i < 16; i++) {
+        float t = 0;
+        for (int c = 0; c < channels; c++) {
+            t += (block[i][c] - mean[c]) * axis[c];
+        }
+        if (i == 0 || t < minT) minT = t;
+        if (i == 0 || t > maxT) maxT = t;
+    }
+    float axisLength = 0;
+    for (int c = 0; c < channels; c++) {
+        axisLength += axis[c] * axis[c];
+    }
+    axisLength = std::max(axisLength, 1e-6f);
+    for (int c = 0; c < channels; c++) {
+        minColor[c] = std::min(std::max(mean[c] + axis[c] * minT / axisLength, 0.0f), 255.0f);
+        maxColor[c] = std::min(std::max(mean[c] + axis[c] * maxT / axisLength, 0.0f), 255.0f);
+    }
+}
+
+static int colorDistance(const unsigned char *a, const int *b, int channels) {
+    int distance = 0;
+    for (int c = 0; c < channels; c++) {
+        distance += (a[c] - b[c]) * (a[c] - b[c]);
+    }
+    return distance;
+}
+
+static uint16_t packRgb565(const float color[4]) {
+    int r = static_cast<int>(color[0] * 31.0f / 255.0f + 0.5f);
+    int g = static_cast<int>(color[1] * 63.0f / 255.0f + 0.5f);
+    int b = static_cast<int>(color[2] * 31.0f / 255.0f + 0.5f);
+    return static_cast<uint16_t>((r << 11) | (g << 5) | b);
+}
+
+static void unpackRgb565(uint16_t color, int out[4]) {
+    out[0] = ((color >> 11) & 31) * 255 / 31;
+    out[1] = ((color >> 5) & 63) * 255 / 63;
+    out[2] = (color & 31) * 255 / 31;
+    out[3] = 255;
+}
+
+/// blocco colore BC1 sempre in modalita' a 4 colori (c0 > c1), come richiesto anche dalla parte colore di BC3
+static void encodeBC1(const unsigned char block[16][4], unsigned char out[8]) {
+    float minColor[4], maxColor[4];
+    principalEndpoints(block, 3, minColor, maxColor);
+    uint16_t c0 = packRgb565(maxColor);
+    uint16_t c1 = packRgb565(minColor);
+    if (c0 < c1) {
+        std::swap(c0, c1);
+    }
+
+    uint32_t indices = 0;
+    if (c0 != c1) {
+        int palette[4][4];
+        unpackRgb565(c0, palette[0]);
+        unpackRgb565(c1, palette[1]);
+        for (int c = 0; c < 3; c++) {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c] + 1) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c] + 1) / 3;
+        }
+        for (int i = 0; i < 16; i++) {
+            int best = 0;
+            for (int p = 1; p < 4; p++) {
+                if (colorDistance(block[i], palette[p], 3) < colorDistance(block[i], palette[best], 3)) {
+                    best = p;
+                }
+            }
+            indices |= static_cast<uint32_t>(best) << (2 * i);
+        }
+    }
+
+    out[0] = c0 & 0xFF;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xFF;
+    out[3] = c1 >> 8;
+    for (int i = 0; i < 4; i++) {
+        out[4 + i] = (indices >> (8 * i)) & 0xFF;
+    }
+}
+
+/// alpha BC3 in modalita' a 8 livelli tra il minimo e il massimo del blocco, seguito dal blocco colore BC1
+static void encodeBC3(const unsigned char block[16][4], unsigned char out[16]) {
+    int a0 = 0, a1 = 255;
+    for (int i = 0; i < 16; i++) {
+        a0 = std::max(a0, static_cast<int>(block[i][3]));
+        a1 = std::min(a1, static_cast<int>(block[i][3]));
+    }
+
+    uint64_t indices = 0;
+    if (a0 != a1) {
+        int palette[8];
+        palette[0] = a0;
+        palette[1] = a1;
+        for (int p = 1; p < 7; p++) {
+            palette[p + 1] = ((7 - p) * a0 + p * a1 + 3) / 7;
+        }
+        for (int i = 0; i < 16; i++) {
+            int best = 0;
+            for (int p = 1; p < 8; p++) {
+                if (std::abs(block[i][3] - palette[p]) < std::abs(block[i][3] - palette[best])) {
+                    best = p;
+                }
+            }
+            indices |= static_cast<uint64_t>(best) << (3 * i);
+        }
+    }
+
+    out[0] = static_cast<unsigned char>(a0);
+    out[1] = static_cast<unsigned char>(a1);
+    for (int i = 0; i < 6; i++) {
+        out[2 + i] = (indices >> (8 * i)) & 0xFF;
+    }
+    encodeBC1(block, out + 8);
+}
+
+static void writeBits(unsigned char out[16], int &position, uint32_t value, int count) {
+    for (int i = 0; i < count; i++, position++) {
+        if (value & (1u << i)) {
+            out[position / 8] |= static_cast<unsigned char>(1u << (position % 8));
+        }
+    }
+}
+
+/// BC7 modo 6: un solo sottoinsieme RGBA con estremi a 7 bit piu' un p-bit ciascuno e indici a 4 bit
+static void encodeBC7(const unsigned char block[16][4], unsigned char out[16]) {
+    static const int weights[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+    float endpoints[2][4];
+    principalEndpoints(block, 4, endpoints[0], endpoints[1]);
+
+    /// per ogni estremo si sceglie il p-bit che approssima meglio il colore con 7 bit per canale
+    int quantized[2][4];
+    int pBits[2];
+    for (int e = 0; e < 2; e++) {
+        int bestError = -1;
+        for (int p = 0; p < 2; p++) {
+            int candidate[4];
+            int error = 0;
+            for (int c = 0; c < 4; c++) {
+                candidate[c] = std::min(std::max(static_cast<int>((endpoints[e][c] - p) / 2.0f + 0.5f), 0), 127);
+                int value = (candidate[c] << 1) | p;
+                error += (value - static_cast<int>(endpoints[e][c])) * (value - static_cast<int>(endpoints[e][c]));
+            }
+            if (bestError < 0 || error < bestError) {
+                bestError = error;
+                pBits[e] = p;
+                memcpy(quantized[e], candidate, sizeof(candidate));
+            }
+        }
+    }
+
+    int palette[16][4];
+    for (int p = 0; p < 16; p++) {
+        for (int c = 0; c < 4; c++) {
+            int e0 = (quantized[0][c] << 1) | pBits[0];
+            int e1 = (quantized[1][c] << 1) | pBits[1];
+            palette[p][c] = ((64 - weights[p]) * e0 + weights[p] * e1 + 32) >> 6;
+        }
+    }
+    int indices[16];
+    for (int i = 0; i < 16; i++) {
+        indices[i] = 0;
+        for (int p = 1; p < 16; p++) {
+            if (colorDistance(block[i], palette[p], 4) < colorDistance(block[i], palette[indices[i]], 4)) {
+                indices[i] = p;
+            }
+        }
+    }
+
+    /// il bit piu' significativo dell'indice del primo pixel e' implicito a 0: se serve si scambiano gli estremi
+    if (indices[0] >= 8) {
+        std::swap(quantized[0], quantized[1]);
+        std::swap(pBits[0], pBits[1]);
+        for (int &index: indices) {
+            index = 15 - index;
+        }
+    }
+
+    memset(out, 0, 16);
+    int position = 0;
+    writeBits(out, position, 1u << 6, 7);
+    for (int c = 0; c < 4; c++) {
+        writeBits(out, position, static_cast<uint32_t>(quantized[0][c]), 7);
+        writeBits(out, position, static_cast<uint32_t>(quantized[1][c]), 7);
+    }
+    writeBits(out, position, static_cast<uint32_t>(pBits[0]), 1);
+    writeBits(out, position, static_cast<uint32_t>(pBits[1]), 1);
+    for (int i = 0; i < 16; i++) {
+        writeBits(out, position, static_cast<uint32_t>(indices[i]), i == 0 ? 3 : 4);
+    }
+}
+
+/// dati di un livello nel formato del contenitore: copiati cosi' come sono per RGBA8, compressi a blocchi altrimenti
+static std::vector<unsigned char> encodeLevel(const Image &image, uint32_t format) {
+    uint32_t blockSize = bakedFormatBlockSize(format);
+    if (blockSize == 0) {
+        return image.pixels;
+    }
+    int blocksX = (image.width + 3) / 4;
+    int blocksY = (image.height + 3) / 4;
+    std::vector<unsigned char> data(static_cast<size_t>(blocksX) * blocksY * blockSize);
+    for (int by = 0; by < blocksY; by++) {
+        for (int bx = 0; bx < blocksX; bx++) {
+            unsigned char block[16][4];
+            readBlock(image, bx, by, block);
+            unsigned char *out = &data[(static_cast<size_t>(by) * blocksX + bx) * blockSize];
+            if (format == BAKED_FORMAT_BC1_RGBA_SRGB) {
+                encodeBC1(block, out);
+            } else if (format == BAKED_FORMAT_BC3_SRGB) {
+                encodeBC3(block, out);
+            } else {
+                encodeBC7(block, out);
+            }
+        }
+    }
+    return data;
+}
+
+/// le facce di dimensioni diverse dalla prima vengono adattate ripetendo l'ultima riga/colonna
+static Image resizeTo(const Image &src, int width, int height) {
+    Image dst{width, height, std::vector<unsigned char>(static_cast<size_t>(width) * height * 4)};
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int sx = std::min(x, src.width - 1);
+            int sy = std::min(y, src.height - 1);
+            memcpy(&dst.pixels[(static_cast<size_t>(y) * width + x) * 4],
+                   &src.pixels[(static_cast<size_t>(sy) * src.width + sx) * 4], 4);
+        }
+    }
+    return dst;
+}
+
+int main(int argc, char **argv) {
+    if (argc == 3 && std::string(argv[1]) == "-b") {
+        Image image{};
+        int channels;
+        stbi_uc *pixels = stbi_load(argv[2], &image.width, &image.height, &channels, STBI_rgb_alpha);
+        if (!pixels) {
+            std::cerr << "failed to load " << argv[2] << std::endl;
+            return EXIT_FAILURE;
+        }
+        image.pixels.assign(pixels, pixels + static_cast<size_t>(image.width) * image.height * 4);
+        stbi_image_free(pixels);
+        benchmark(image);
+        return EXIT_SUCCESS;
+    }
+
+    std::string formatName = "rgba8";
+    int first = 1;
+    if (argc > 2 && std::string(argv[1]) == "-f") {
+        formatName = argv[2];
+        first = 3;
+    }
+    int inputs = argc - first - 1;
+    if (inputs != 1 && inputs != 6) {
+        std::cerr << "usage: " << argv[0] << " [-f rgba8|bc|bc1|bc3|bc7] <output.dtex> <input.png> [5 more cubemap faces]"
+                  << std::endl << "       " << argv[0] << " -b <input.png>" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const char *output = argv[first];
+
+    std::vector<std::vector<Image>> faces;
+    bool opaque = true;
+    for (int i = first + 1; i < argc; i++) {
+        Image image{};
+        int channels;
+        stbi_uc *pixels = stbi_load(argv[i], &image.width, &image.height, &channels, STBI_rgb_alpha);
+        if (!pixels) {
+            std::cerr << "failed to load " << argv[i] << std::endl;
+            return EXIT_FAILURE;
+        }
+        image.pixels.assign(pixels, pixels + static_cast<size_t>(image.width) * image.height * 4);
+        stbi_image_free(pixels);
+
+        if (!faces.empty() && (image.width != faces[0][0].width || image.height != faces[0][0].height)) {
+            image = resizeTo(image, faces[0][0].width, faces[0][0].height);
+        }
+        for (size_t p = 3; p < image.pixels.size(); p += 4) {
+            opaque = opaque && image.pixels[p] == 255;
+        }
+        faces.push_back({image});
+    }
+
+    BakedTextureHeader header{};
+    memcpy(header.magic, BAKED_TEXTURE_MAGIC, sizeof(header.magic));
+    header.version = BAKED_TEXTURE_VERSION;
+    if (formatName == "rgba8") {
+        header.format = BAKED_FORMAT_R8G8B8A8_SRGB;
+    } else if (formatName == "bc") {
+        header.format = opaque ? BAKED_FORMAT_BC1_RGBA_SRGB : BAKED_FORMAT_BC3_SRGB;
+    } else if (formatName == "bc1") {
+        header.format = BAKED_FORMAT_BC1_RGBA_SRGB;
+    } else if (formatName == "bc3") {
+        header.format = BAKED_FORMAT_BC3_SRGB;
+    } else if (formatName == "bc7") {
+        header.format = BAKED_FORMAT_BC7_SRGB;
+    } else {
+        std::cerr << "unknown format " << formatName << std::endl;
+        return EXIT_FAILURE;
+    }
+    header.width = faces[0][0].width;
+    header.height = faces[0][0].height;
+    header.mipLevels = std::min(static_cast<uint32_t>(std::floor(std::log2(std::max(header.width, header.height)))) + 1,
+                                BAKED_TEXTURE_MAX_LEVELS);
+    header.layers = static_cast<uint32_t>(faces.size());
+
+    for (auto &chain: faces) {
+        for (uint32_t level = 1; level < header.mipLevels; level++) {
+            chain.push_back(downsample(chain.back()));
+        }
+    }
+
+    /// encoded[livello][faccia]
+    std::vector<std::vector<std::vector<unsigned char>>> encoded(header.mipLevels);
+    uint64_t offset = sizeof(BakedTextureHeader);
+    for (uint32_t level = 0; level < header.mipLevels; level++) {
+        for (const auto &chain: faces) {
+            encoded[level].push_back(encodeLevel(chain[level], header.format));
+        }
+        offset = (offset + BAKED_TEXTURE_ALIGNMENT - 1) & ~(BAKED_TEXTURE_ALIGNMENT - 1);
+        header.levels[level].offset = offset;
+        header.levels[level].size = encoded[level][0].size() * header.layers;
+        header.levels[level].width = faces[0][level].width;
+        header.levels[level].height = faces[0][level].height;
+        offset += header.levels[level].size;
+    }
+
+    std::ofstream out(output, std::ios::binary);
+    if (!out) {
+        std::cerr << "failed to open " << output << std::endl;
+        return EXIT_FAILURE;
+    }
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (uint32_t level = 0; level < header.mipLevels; level++) {
+        std::vector<char> padding(header.levels[level].offset - static_cast<uint64_t>(out.tellp()), 0);
+        out.write(padding.data(), static_cast<std::streamsize>(padding.size()));
+        for (const auto &face: encoded[level]) {
+            out.write(reinterpret_cast<const char *>(face.data()), static_cast<std::streamsize>(face.size()));
+        }
+    }
+
+    std::cout << output << ": " << header.width << "x" << header.height << ", " << header.mipLevels
+              << " levels, " << header.layers << " layers, " << formatName << ", "
+              << static_cast<uint64_t>(out.tellp()) << " bytes" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,27 @@
+#version 450
+
+// depth pre-pass: solo la posizione, calcolata come negli shader di terreno e drone. invariant garantisce la
+// stessa profondita' nei due passaggi, necessaria per il confronto EQUAL del terreno
+layout(set = 0, binding = 0) uniform globalUniformBufferObject {
+	mat4 view;
+	mat4 proj;
+} gubo;
+
+layout(set = 1, binding = 0) uniform UniformBufferObject {
+	vec4 posOffset;
+	vec4 posScale;
+} ubo;
+
+layout(push_constant) uniform ObjectPushConstants {
+	mat4 model;
+	vec4 textureInfo;
+} pc;
+
+layout(location = 0) in vec3 pos;
+
+invariant gl_Position;
+
+void main() {
+	vec3 p = ubo.posOffset.xyz + pos * ubo.posScale.xyz;
+	gl_Position = gubo.proj * gubo.view * pc.model * vec4(p, 1.0);
+}
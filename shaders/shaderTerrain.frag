@@ -1,6 +1,15 @@
 #version 450
 
-layout(set = 1,binding = 1) uniform sampler2D texSampler;
+
+layout(push_constant) uniform ObjectPushConstants {
+	mat4 model;
+	// x: primo livello di mip residente (streaming), i livelli piu' grandi non sono ancora caricati
+	// y: indice della texture nell'array condiviso
+	vec4 textureInfo;
+} pc;
+
+// stesso valore di MAX_OBJECT_TEXTURES
+layout(set = 2, binding = 0) uniform sampler2D textures[4];
 
 layout(location = 0) in vec3 fragViewDir;
 layout(location = 1) in vec3 fragNorm;
@@ -27,7 +36,10 @@ vec3 Oren_Nayar_Diffuse_BRDF(vec3 L, vec3 N, vec3 V, vec3 C, float sigma) {
 }
 
 void main() {
-	const vec3  diffColor = texture(texSampler, fragTexCoord).rgb;
+	// bias che porta il lod calcolato almeno al primo livello residente, senza perdere il filtro anisotropico
+	int textureIndex = int(pc.textureInfo.y);
+	float lodBias = max(pc.textureInfo.x - textureQueryLod(textures[textureIndex], fragTexCoord).y, 0.0f);
+	const vec3  diffColor = texture(textures[textureIndex], fragTexCoord, lodBias).rgb;
 	const vec3  specColor = vec3(1.0f, 1.0f, 1.0f);
 	const float specPower = 150.0f;
 	const vec3  L = vec3(-0.4830f, 0.8365f, -0.2588f);
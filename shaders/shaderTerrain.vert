@@ -6,9 +6,19 @@ layout(set = 0, binding = 0) uniform globalUniformBufferObject {
 } gubo;
 
 layout(set = 1, binding = 0) uniform UniformBufferObject {
-	mat4 model;
+	vec4 posOffset;
+	vec4 posScale;
 } ubo;
 
+// matrice dell'oggetto, aggiornata ad ogni draw
+layout(push_constant) uniform ObjectPushConstants {
+	mat4 model;
+	vec4 textureInfo;
+} pc;
+
+// vero se la pipeline usa PackedVertex (posizioni quantizzate e normali ottaedriche)
+layout(constant_id = 0) const bool PACKED_VERTICES = false;
+
 layout(location = 0) in vec3 pos;
 layout(location = 1) in vec3 norm;
 layout(location = 2) in vec2 texCoord;
@@ -18,12 +28,25 @@ layout(location = 1) out vec3 fragNorm;
 layout(location = 2) out vec2 fragTexCoord;
 layout(location = 3) out float v_fogDepth;
 
+// stessa profondita' del depth pre-pass (shaderDepth.vert)
+invariant gl_Position;
+
+vec3 octDecode(vec2 e) {
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0) {
+		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	}
+	return normalize(n);
+}
+
 void main() {
-	gl_Position = gubo.proj * gubo.view * ubo.model * vec4(pos, 1.0);
-	fragViewDir  = (gubo.view[3]).xyz - (ubo.model * vec4(pos,  1.0)).xyz;
-	fragNorm     = (ubo.model * vec4(norm, 0.0)).xyz;
+	vec3 p = ubo.posOffset.xyz + pos * ubo.posScale.xyz;
+	vec3 n = PACKED_VERTICES ? octDecode(norm.xy) : norm;
+	gl_Position = gubo.proj * gubo.view * pc.model * vec4(p, 1.0);
+	fragViewDir  = (gubo.view[3]).xyz - (pc.model * vec4(p,  1.0)).xyz;
+	fragNorm     = (pc.model * vec4(n, 0.0)).xyz;
 	fragTexCoord = texCoord;
-	//v_fogDepth = -( gubo.view * ubo.model * vec4(pos, 1.0)).z;
+	//v_fogDepth = -( gubo.view * pc.model * vec4(pos, 1.0)).z;
 	// nebbai eliminata
 	v_fogDepth = 0.f;
 }
\ No newline at end of file